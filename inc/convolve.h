@@ -0,0 +1,224 @@
+#ifndef CONVOLVE_H
+#define CONVOLVE_H
+
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "kernel.h"
+#include "vec.h"
+
+// Row steps shared by the image filters and StreamFilter.
+// Rows are w pixels wide, and taps past either end of a row
+// read its edge pixel.
+
+// Finishes a filtered pixel, which has alpha set to 255 and
+// is optionally divided by the kernel's absolute magnitude
+inline ivec4 finish_filter(ivec4 v, double inv_kmag) {
+    v.a = 255;
+    if (inv_kmag != 0.0) {
+        v = v.scale(inv_kmag);
+    }
+    return v;
+}
+
+// A kernel's non-zero taps expanded into flat arrays once
+// per filter, so the inner loops only walk a list
+struct FlatKernel {
+    // Weight for the pixel dx columns across in prepared
+    // row dy of those passed to filter_emit_row
+    struct Tap {
+        int dy, dx, weight;
+    };
+
+    int w, h;
+    bool separable;
+    // Furthest reach of a tap to the left and the right
+    int left, right;
+    // Every tap of a direct kernel, or the row factor of a
+    // separable one with dy = 0
+    std::vector<Tap> taps;
+    // Column factor of a separable kernel, with dx = 0
+    std::vector<Tap> col_taps;
+
+    explicit FlatKernel(const Kernel& k)
+        : w{k.w},
+          h{k.h},
+          separable{k.separable()},
+          left{k.w / 2},
+          right{k.w - 1 - k.w / 2} {
+        auto add = [](std::vector<Tap>& v, int dy, int dx,
+                      int weight) {
+            if (weight != 0) {
+                v.push_back(Tap{dy, dx, weight});
+            }
+        };
+        if (separable) {
+            for (int ki = 0; ki < k.w; ki++) {
+                add(taps, 0, ki - left, k.row_px(ki));
+            }
+            for (int kj = 0; kj < k.h; kj++) {
+                add(col_taps, kj, 0, k.col_px(kj));
+            }
+        } else {
+            for (int kj = 0; kj < k.h; kj++) {
+                for (int ki = 0; ki < k.w; ki++) {
+                    int weight = k.get_px(ki, kj);
+                    add(taps, kj, ki - left, weight);
+                }
+            }
+        }
+    }
+};
+
+// Calls f(i, index) for each column i of a row w wide,
+// where index(x) turns a tap's column into an index into
+// the row. Only the border columns within reach of either
+// end clamp, and the interior indexes directly without
+// branches.
+template <typename F>
+void split_row(int w, int left, int right, F f) {
+    auto clamped = [w](int x) {
+        return std::clamp(x, 0, w - 1);
+    };
+    auto direct = [](int x) { return x; };
+    int lo = std::min(w, left);
+    int hi = std::max(lo, w - right);
+    for (int i = 0; i < lo; i++) {
+        f(i, clamped);
+    }
+    for (int i = lo; i < hi; i++) {
+        f(i, direct);
+    }
+    for (int i = hi; i < w; i++) {
+        f(i, clamped);
+    }
+}
+
+// First pass over a source row. A separable kernel applies
+// its row factor here, and any other kernel just widens the
+// row.
+template <typename T>
+void filter_prep_row(const FlatKernel& k,
+                     const vec4<T>* src, int w,
+                     ivec4* dst) {
+    if (!k.separable) {
+        std::transform(src, src + w, dst,
+                       vec4_cast<int, T>);
+        return;
+    }
+    split_row(w, k.left, k.right, [&](int i, auto index) {
+        auto acc = ivec4::zero;
+        for (const auto& t : k.taps) {
+            auto v = vec4_cast<int>(src[index(i + t.dx)]);
+            acc = acc.add(v.scale(t.weight));
+        }
+        dst[i] = acc;
+    });
+}
+
+// Second pass, giving a finished row from the k.h prepared
+// rows around it, where rows[kj] is kj - k.h / 2 rows away.
+// A separable kernel applies its column factor, and any
+// other kernel the full 2D sum. Integer sums make both
+// paths exact.
+template <typename T>
+void filter_emit_row(const FlatKernel& k,
+                     const ivec4* const* rows, int w,
+                     double inv_kmag, vec4<T>* out) {
+    if (k.separable) {
+        for (int i = 0; i < w; i++) {
+            auto acc = ivec4::zero;
+            for (const auto& t : k.col_taps) {
+                auto v = rows[t.dy][i];
+                acc = acc.add(v.scale(t.weight));
+            }
+            out[i] =
+                vec4_cast<T>(finish_filter(acc, inv_kmag));
+        }
+        return;
+    }
+    split_row(w, k.left, k.right, [&](int i, auto index) {
+        auto acc = ivec4::zero;
+        for (const auto& t : k.taps) {
+            auto v = rows[t.dy][index(i + t.dx)];
+            acc = acc.add(v.scale(t.weight));
+        }
+        out[i] =
+            vec4_cast<T>(finish_filter(acc, inv_kmag));
+    });
+}
+
+// Calls f(std::integral_constant<int, i>()) for each i in
+// [0, N), unrolled
+template <int N, typename F>
+void static_for(F f) {
+    [&]<int... I>(std::integer_sequence<int, I...>) {
+        (f(std::integral_constant<int, I>()), ...);
+    }(std::make_integer_sequence<int, N>());
+}
+
+// filter_prep_row for a FixedKernel or FixedSeparableKernel
+// given as a template argument, with every tap unrolled
+template <auto K, typename T>
+void fixed_prep_row(const vec4<T>* src, int w, ivec4* dst) {
+    if constexpr (!K.separable) {
+        std::transform(src, src + w, dst,
+                       vec4_cast<int, T>);
+    } else {
+        constexpr int left = K.w / 2;
+        constexpr int right = K.w - 1 - left;
+        split_row(w, left, right, [&](int i, auto index) {
+            auto acc = ivec4::zero;
+            static_for<K.w>([&](auto ki) {
+                constexpr int weight = K.row[ki];
+                if constexpr (weight != 0) {
+                    int x = index(i + ki - left);
+                    auto v = vec4_cast<int>(src[x]);
+                    acc = acc.add(v.scale(weight));
+                }
+            });
+            dst[i] = acc;
+        });
+    }
+}
+
+// filter_emit_row for a FixedKernel or FixedSeparableKernel
+// given as a template argument, with every tap unrolled
+template <auto K, typename T>
+void fixed_emit_row(const ivec4* const* rows, int w,
+                    double inv_kmag, vec4<T>* out) {
+    constexpr int left = K.w / 2;
+    constexpr int right = K.w - 1 - left;
+    if constexpr (K.separable) {
+        for (int i = 0; i < w; i++) {
+            auto acc = ivec4::zero;
+            static_for<K.h>([&](auto kj) {
+                constexpr int weight = K.col[kj];
+                if constexpr (weight != 0) {
+                    auto v = rows[kj][i];
+                    acc = acc.add(v.scale(weight));
+                }
+            });
+            out[i] =
+                vec4_cast<T>(finish_filter(acc, inv_kmag));
+        }
+    } else {
+        split_row(w, left, right, [&](int i, auto index) {
+            auto acc = ivec4::zero;
+            static_for<K.w * K.h>([&](auto t) {
+                constexpr int weight = K.weights[t];
+                if constexpr (weight != 0) {
+                    constexpr int kj = t / K.w;
+                    constexpr int ki = t % K.w;
+                    auto v = rows[kj][index(i + ki - left)];
+                    acc = acc.add(v.scale(weight));
+                }
+            });
+            out[i] =
+                vec4_cast<T>(finish_filter(acc, inv_kmag));
+        });
+    }
+}
+
+#endif
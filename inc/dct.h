@@ -3,8 +3,20 @@
 
 #include "image.h"
 
+// Blockwise 2D DCT-II of an image's colour channels, and
+// its inverse. Blocks are transformed row by row and then
+// column by column with a fast O(N log N) 1D transform,
+// and bands of block rows are spread across threads.
+// Coefficients match the direct O(N^4) sum up to floating
+// point rounding, so truncated coefficients may differ from
+// it by one. Decoded pixels are rounded to the nearest
+// integer, so they are within one of a truncated direct
+// inverse, and unmodified coefficients decode exactly.
 class Dct {
    public:
+    // Side of the square blocks, one of 8, 16, 32 or 64.
+    // Each size has its own specialised transform.
+    int block_size;
     int w, h;
 
    private:
@@ -13,14 +25,16 @@ class Dct {
     const dvec4& get_px(int bi, int bj, int i, int j) const;
     dvec4& get_px(int bi, int bj, int i, int j);
     int block_idx(int bi, int bj, int i, int j) const;
-    void encode_block(std::vector<dvec4>& decode, int bi,
-                      int bj);
+    template <int N>
+    void encode_block(const Image& image, int bi, int bj);
+    template <int N>
     void decode_block(std::vector<ivec4>& out, int bi,
                       int bj) const;
 
    public:
-    Dct(const Image& image);
-    Dct(const std::vector<ivec4>& data, int w, int h);
+    Dct(const Image& image, int block_size = 32);
+    Dct(const std::vector<ivec4>& data, int w, int h,
+        int block_size = 32);
 
     Image dump_image() const;
     Image to_image_decode() const;
@@ -0,0 +1,38 @@
+#ifndef FFT_H
+#define FFT_H
+
+#include <complex>
+#include <vector>
+
+// Radix-2 complex FFT of a fixed power-of-two length n,
+// with the twiddle factors and bit-reversal permutation
+// computed once up front
+class Fft {
+   public:
+    using complex = std::complex<double>;
+
+    const int n;
+
+   private:
+    // exp(-2 pi i k / n) for k < n / 2
+    std::vector<complex> twiddles;
+    std::vector<int> bit_reverse;
+
+    void transform(complex* x, bool inverse) const;
+
+   public:
+    // Throws std::invalid_argument unless n is a power of
+    // two
+    explicit Fft(int n);
+
+    // In place on n values. The inverse is scaled by 1 / n,
+    // so it undoes forward exactly up to rounding.
+    void forward(complex* x) const;
+    void inverse(complex* x) const;
+
+    // In place on n x n values in row-major order
+    void forward_2d(complex* x) const;
+    void inverse_2d(complex* x) const;
+};
+
+#endif
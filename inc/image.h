@@ -6,78 +6,141 @@
 #include <random>
 
 #include "kernel.h"
+#include "parallel.h"
 #include "vec.h"
 
-class Image {
+// Image stored with channel type T. Operations widen each
+// pixel to ivec4, so intermediate values have headroom, and
+// narrow the result back to T when storing it.
+template <typename T>
+class BasicImage {
    public:
     int w, h;
-    std::vector<ivec4> data;
+    std::vector<vec4<T>> data;
 
    private:
-    Image& apply_filter(const Kernel& kernel,
-                        bool normalise);
+    // Built by luminance() and cleared whenever a method
+    // changes the pixels
+    mutable std::vector<int> lum_cache;
+
+    template <typename Dir, typename Measure>
+    BasicImage& streak(Measure measure);
+    BasicImage& apply_fft_filter(const Kernel& kernel,
+                                 bool normalise);
+    template <auto K>
+    BasicImage& apply_fixed_filter(bool normalise);
 
    public:
-    Image(int w, int h);
-    explicit Image(const std::vector<ivec4>& data, int w,
-                   int h);
-    explicit Image(const std::vector<uvec4>& data, int w,
-                   int h);
-
-    const ivec4& get_px(int x, int y) const;
-    ivec4& get_px(int x, int y);
-
-    void set_px(int x, int y, const ivec4& v);
-
-    Image duplicate() const;
-
-    Image& posterise(bool ignore_alpha);
-    Image& streak(
-        const std::vector<int> h_iter,
-        const std::vector<int> v_iter,
-        const std::function<
-            std::optional<int>(int, int, int, int, int)>
-            get_streak_idx,
-        const std::function<int(const ivec4&)> measure,
-        const std::optional<Image>& measure_source =
+    BasicImage(int w, int h);
+    explicit BasicImage(const std::vector<ivec4>& data,
+                        int w, int h);
+    explicit BasicImage(const std::vector<uvec4>& data,
+                        int w, int h);
+    // Takes ownership of the pixels without copying
+    explicit BasicImage(std::vector<vec4<T>>&& data, int w,
+                        int h);
+
+    const vec4<T>& get_px(int x, int y) const;
+    vec4<T>& get_px(int x, int y);
+
+    void set_px(int x, int y, const vec4<T>& v);
+
+    // Luminance of every pixel in 8.8 fixed point, i.e.
+    // static_cast<int>(luminance() * 256). It is computed
+    // on first use and cached until the pixels change
+    // through a method, which frees it, so code writing to
+    // `data` directly must call invalidate_luminance().
+    // Not safe to call from several threads while the
+    // cache is empty.
+    const std::vector<int>& luminance() const;
+    void invalidate_luminance();
+
+    BasicImage duplicate() const;
+
+    // Applies f to every pixel, widened to ivec4, in one
+    // parallel pass. Every point-wise method and Pipeline
+    // goes through here, so f is called on several threads
+    // at once.
+    template <typename F>
+    BasicImage& map(F f);
+
+    BasicImage& posterise(bool ignore_alpha = true);
+    BasicImage& streak_down(
+        const std::optional<BasicImage>& measure_source =
+            std::nullopt);
+    BasicImage& streak_up(
+        const std::optional<BasicImage>& measure_source =
+            std::nullopt);
+    BasicImage& streak_left(
+        const std::optional<BasicImage>& measure_source =
+            std::nullopt);
+    BasicImage& streak_right(
+        const std::optional<BasicImage>& measure_source =
             std::nullopt);
-    Image& streak_down(const std::optional<Image>&
-                           measure_source = std::nullopt);
-    Image& streak_up(const std::optional<Image>&
-                         measure_source = std::nullopt);
-    Image& streak_left(const std::optional<Image>&
-                           measure_source = std::nullopt);
-    Image& streak_right(const std::optional<Image>&
-                            measure_source = std::nullopt);
-
-    Image& apply_function(
-        const std::function<ivec4(ivec4&)> f);
 
-    Image& add(const Image& other, double other_ratio);
-
-    Image& half_size();
-    Image& abs();
-    Image& clamp_zero();
-    Image& hard_clamp(double max = 255.0);
-    Image& smooth_clamp(double half = 127.0,
-                        double max = 255.0);
-    Image& modulo(int mod);
-
-    Image& scale(double c);
-    Image& remove_red();
-    Image& remove_green();
-    Image& remove_blue();
-    Image& black_and_white();
-
-    Image& rgb_to_hsv();
-    Image& hsv_to_rgb();
-
-    Image& sobel_horizontal(bool normalise);
-    Image& sobel_vertical(bool normalise);
-    Image& laplacian3(bool normalise);
-    Image& laplacian5(bool normalise);
-    Image& box(bool normalise = true);
-    Image& gaussian(bool normalise = true);
+    // f is called on several threads at once, in no
+    // particular pixel order, so it must be safe to call
+    // concurrently, e.g. with no shared RNG or counter
+    BasicImage& apply_function(
+        const std::function<ivec4(ivec4&)> f);
+    // Convolves with any kernel, taking the frequency
+    // domain path for kernels too large to sum directly
+    BasicImage& apply_filter(const Kernel& kernel,
+                             bool normalise);
+
+    BasicImage& add(const BasicImage& other,
+                    double other_ratio);
+
+    BasicImage& half_size();
+    BasicImage& abs();
+    BasicImage& clamp_zero();
+    BasicImage& hard_clamp(double max = 255.0);
+    BasicImage& smooth_clamp(double half = 127.0,
+                             double max = 255.0);
+    BasicImage& modulo(int mod);
+
+    BasicImage& scale(double c);
+    BasicImage& remove_red();
+    BasicImage& remove_green();
+    BasicImage& remove_blue();
+    BasicImage& black_and_white();
+
+    BasicImage& rgb_to_hsv();
+    BasicImage& hsv_to_rgb();
+
+    BasicImage& sobel_horizontal(bool normalise);
+    BasicImage& sobel_vertical(bool normalise);
+    BasicImage& laplacian3(bool normalise);
+    BasicImage& laplacian5(bool normalise);
+    BasicImage& box(bool normalise = true);
+    // Blurs over a (2 * radius + 1) square in time
+    // independent of the radius, saturating results that do
+    // not fit the channel type. Throws
+    // std::invalid_argument for radii over 32766 on an
+    // Image, or about 95 million on a UImage, where 64-bit
+    // sums could overflow.
+    BasicImage& box_blur(int radius, bool normalise = true);
+    BasicImage& gaussian(bool normalise = true);
 };
 
+template <typename T>
+template <typename F>
+BasicImage<T>& BasicImage<T>::map(F f) {
+    invalidate_luminance();
+    auto g = [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            auto v = vec4_cast<int>(data[i]);
+            data[i] = vec4_cast<T>(f(v));
+        }
+    };
+    parallel_for(0, data.size(), g, PX_GRAIN);
+    return *this;
+}
+
+// Working image with signed headroom, e.g. for filters
+using Image = BasicImage<int>;
+// Compact 8-bit image, matching the decoded PNG layout.
+// Values outside [0, 255] wrap when stored.
+using UImage = BasicImage<unsigned char>;
+
 #endif
@@ -1,17 +1,42 @@
 #ifndef KERNEL_H
 #define KERNEL_H
 
+#include <algorithm>
+#include <array>
+#include <numeric>
 #include <vector>
 
 class Kernel {
    private:
     const std::vector<int> kernel;
+    // Factors such that kernel[y * w + x] is
+    // col[y] * row[x], both empty if not separable.
+    std::vector<int> row, col;
+
+    static std::vector<int> outer(
+        const std::vector<int>& row,
+        const std::vector<int>& col);
+    void factorise();
 
    public:
     const int w, h;
 
     Kernel(std::vector<int> k, int w, int h)
-        : kernel{k}, w{w}, h{h} {}
+        : kernel{k}, w{w}, h{h} {
+        factorise();
+    }
+
+    // Separable kernel given as the outer product col * row
+    Kernel(std::vector<int> row, std::vector<int> col)
+        : kernel{outer(row, col)},
+          row{row},
+          col{col},
+          w{static_cast<int>(row.size())},
+          h{static_cast<int>(col.size())} {}
+
+    bool separable() const { return !row.empty(); }
+    int row_px(int x) const { return row[x]; }
+    int col_px(int y) const { return col[y]; }
 
     int get_px(int x, int y) const {
         if (x < 0) {
@@ -36,4 +61,92 @@ class Kernel {
     }
 };
 
+inline std::vector<int> Kernel::outer(
+    const std::vector<int>& row,
+    const std::vector<int>& col) {
+    std::vector<int> k(row.size() * col.size());
+    for (size_t y = 0; y < col.size(); y++) {
+        for (size_t x = 0; x < row.size(); x++) {
+            k[y * row.size() + x] = col[y] * row[x];
+        }
+    }
+    return k;
+}
+
+// Splits a rank-one kernel into integer row and column
+// factors. The pivot row is reduced by its GCD, so every
+// other row is an integer multiple of it.
+inline void Kernel::factorise() {
+    auto pivot =
+        std::find_if(kernel.cbegin(), kernel.cend(),
+                     [](int v) { return v != 0; });
+    if (pivot == kernel.cend()) {
+        return;
+    }
+    int pi = static_cast<int>(pivot - kernel.cbegin());
+    int px = pi % w, py = pi / w;
+    int g = 0;
+    for (int x = 0; x < w; x++) {
+        g = std::gcd(g, kernel[py * w + x]);
+    }
+    std::vector<int> r(w), c(h);
+    for (int x = 0; x < w; x++) {
+        r[x] = kernel[py * w + x] / g;
+    }
+    for (int y = 0; y < h; y++) {
+        c[y] = kernel[y * w + px] / r[px];
+    }
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            if (c[y] * r[x] != kernel[y * w + x]) {
+                return;
+            }
+        }
+    }
+    row = std::move(r);
+    col = std::move(c);
+}
+
+// Kernel whose size and weights are fixed at compile time.
+// Passed as a template argument, its loops fully unroll and
+// zero taps drop out. Weights are row-major.
+template <int W, int H>
+struct FixedKernel {
+    static constexpr int w = W;
+    static constexpr int h = H;
+    static constexpr bool separable = false;
+
+    std::array<int, W * H> weights;
+
+    constexpr int abs_mag() const {
+        int mag = 0;
+        for (int v : weights) {
+            mag += v < 0 ? -v : v;
+        }
+        return mag;
+    }
+};
+
+// Fixed kernel given as the outer product col * row
+template <int W, int H>
+struct FixedSeparableKernel {
+    static constexpr int w = W;
+    static constexpr int h = H;
+    static constexpr bool separable = true;
+
+    std::array<int, W> row;
+    std::array<int, H> col;
+
+    constexpr int abs_mag() const {
+        int row_mag = 0, col_mag = 0;
+        for (int v : row) {
+            row_mag += v < 0 ? -v : v;
+        }
+        for (int v : col) {
+            col_mag += v < 0 ? -v : v;
+        }
+        return row_mag * col_mag;
+    }
+};
+
 #endif
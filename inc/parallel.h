@@ -0,0 +1,23 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <functional>
+
+// Number of threads used by parallel_for. Defaults to the
+// hardware concurrency, and values below one count as one.
+void set_num_threads(int n);
+int get_num_threads();
+
+// Splits [begin, end) into contiguous chunks of at least
+// `grain` indices, at most one per thread, and calls
+// f(chunk_begin, chunk_end) for each. The calling thread
+// runs the first chunk, and the call returns once every
+// chunk is done.
+void parallel_for(int begin, int end,
+                  const std::function<void(int, int)>& f,
+                  int grain = 1);
+
+// Minimum pixels, or runs, per thread for point-wise loops
+inline constexpr int PX_GRAIN = 1 << 14;
+
+#endif
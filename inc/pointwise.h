@@ -0,0 +1,162 @@
+#ifndef POINTWISE_H
+#define POINTWISE_H
+
+#include <tuple>
+
+#include "image.h"
+#include "simd.h"
+
+// Point-wise operations on a widened pixel, matching the
+// BasicImage methods of the same name
+
+inline constexpr int POSTERISATION_LEVELS = 8;
+inline constexpr unsigned char POSTERISATION_COEFF =
+    256 / POSTERISATION_LEVELS;
+
+inline unsigned char posterise_value(unsigned char v) {
+    if (v == 255) {
+        return v;
+    }
+    return (v / POSTERISATION_COEFF) * POSTERISATION_COEFF;
+}
+
+// Channels are taken as 8 bits before posterising
+struct PosteriseOp {
+    bool ignore_alpha = true;
+
+    ivec4 operator()(ivec4 v) const {
+        v.r = posterise_value(v.r);
+        v.g = posterise_value(v.g);
+        v.b = posterise_value(v.b);
+        if (!ignore_alpha) {
+            v.a = posterise_value(v.a);
+        }
+        return v;
+    }
+};
+
+struct AbsOp {
+    ivec4 operator()(ivec4 v) const { return v.abs(); }
+};
+
+struct ClampZeroOp {
+    ivec4 operator()(ivec4 v) const { return v.min_zero(); }
+};
+
+struct HardClampOp {
+    double max = 255.0;
+
+    ivec4 operator()(ivec4 v) const {
+        return v.hard_clamp(max);
+    }
+};
+
+struct SmoothClampOp {
+    double half = 127.0;
+    double max = 255.0;
+
+    ivec4 operator()(ivec4 v) const {
+        return v.smooth_clamp(half, max);
+    }
+};
+
+struct ModuloOp {
+    int mod;
+
+    ivec4 operator()(ivec4 v) const {
+        return v.modulo(mod);
+    }
+};
+
+struct ScaleOp {
+    double c;
+
+    ivec4 operator()(ivec4 v) const { return v.scale(c); }
+};
+
+struct RemoveRedOp {
+    ivec4 operator()(ivec4 v) const {
+        v.r = 0;
+        return v;
+    }
+};
+
+struct RemoveGreenOp {
+    ivec4 operator()(ivec4 v) const {
+        v.g = 0;
+        return v;
+    }
+};
+
+struct RemoveBlueOp {
+    ivec4 operator()(ivec4 v) const {
+        v.b = 0;
+        return v;
+    }
+};
+
+// Uses the same kernel as the luminance cache, so it
+// matches BasicImage::black_and_white exactly
+struct BlackAndWhiteOp {
+    ivec4 operator()(ivec4 v) const {
+        int lum;
+        span_luminance_8_8(&v, &lum, 1);
+        lum /= 256;
+        return ivec4{lum, lum, lum, 255};
+    }
+};
+
+struct RgbToHsvOp {
+    ivec4 operator()(ivec4 v) const {
+        return v.rgb_to_hsv();
+    }
+};
+
+struct HsvToRgbOp {
+    ivec4 operator()(ivec4 v) const {
+        return v.hsv_to_rgb();
+    }
+};
+
+// Sequence of point-wise operations, run one after another
+// on each pixel in a single pass over the image. Any
+// callable taking and returning ivec4 can be a step, e.g.
+//
+//     Pipeline{RgbToHsvOp{}, f, ModuloOp{256}}
+//         .then(HsvToRgbOp{})
+//         .apply(image);
+//
+// Pixels stay widened between steps, so on a UImage only
+// the final result wraps, where chaining the methods wraps
+// after every step.
+template <typename... Ops>
+class Pipeline {
+   private:
+    std::tuple<Ops...> ops;
+
+   public:
+    Pipeline(Ops... ops) : ops{ops...} {}
+
+    template <typename Op>
+    Pipeline<Ops..., Op> then(Op op) const {
+        return std::apply(
+            [&](const Ops&... o) {
+                return Pipeline<Ops..., Op>(o..., op);
+            },
+            ops);
+    }
+
+    ivec4 operator()(ivec4 v) const {
+        std::apply(
+            [&](const Ops&... o) { ((v = o(v)), ...); },
+            ops);
+        return v;
+    }
+
+    template <typename T>
+    BasicImage<T>& apply(BasicImage<T>& image) const {
+        return image.map(*this);
+    }
+};
+
+#endif
@@ -2,22 +2,81 @@
 #define RLE_H
 
 #include <random>
+#include <string>
 
 #include "image.h"
+#include "parallel.h"
 
+// Runs never cross a row boundary, and row_offsets[y] is
+// the index of the first run of row y, with
+// row_offsets[h] the total number of runs
 class Rle {
    public:
     std::vector<int> lengths;
     std::vector<ivec4> colours;
+    std::vector<int> row_offsets;
     int w, h;
 
+   private:
+    Rle(int w, int h);
+    void index_rows();
+
+   public:
     Rle(const Image& image);
     Image to_image() const;
 
+    // Stores the runs in the RleWriter format, so channels
+    // are kept as 8 bits and runs are split at rows
+    void save(const std::string& path) const;
+    static Rle load(const std::string& path);
+
     void encode(const std::vector<ivec4>& data);
 
     void add_noise(double stddev);
-    void add_noise_rows(double stddev);
+    // Rows are independent, each with its own random
+    // stream seeded from seed and the row, so the result
+    // does not depend on the number of threads
+    void add_noise_rows(double stddev = 1.0,
+                        unsigned int seed = 0);
+
+    // Point-wise operations, matching the Image methods of
+    // the same name. They only depend on a pixel's value,
+    // so each is applied once per run rather than once per
+    // pixel. Runs keep their lengths, even where
+    // neighbours end up the same colour.
+    //
+    // map takes any callable from ivec4 to ivec4, such as
+    // the ops in pointwise.h or a Pipeline of them.
+    template <typename F>
+    Rle& map(F f);
+
+    Rle& posterise(bool ignore_alpha = true);
+    Rle& abs();
+    Rle& clamp_zero();
+    Rle& hard_clamp(double max = 255.0);
+    Rle& smooth_clamp(double half = 127.0,
+                      double max = 255.0);
+    Rle& modulo(int mod);
+
+    Rle& scale(double c);
+    Rle& remove_red();
+    Rle& remove_green();
+    Rle& remove_blue();
+    Rle& black_and_white();
+
+    Rle& rgb_to_hsv();
+    Rle& hsv_to_rgb();
 };
 
+template <typename F>
+Rle& Rle::map(F f) {
+    auto g = [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            colours[i] = f(colours[i]);
+        }
+    };
+    parallel_for(0, colours.size(), g, PX_GRAIN);
+    return *this;
+}
+
 #endif
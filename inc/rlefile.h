@@ -0,0 +1,69 @@
+#ifndef RLEFILE_H
+#define RLEFILE_H
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "vec.h"
+
+// Run-length encoded image file. After a header of "DRLE",
+// a version byte and the width and height as varints, each
+// row is stored as runs covering exactly its w pixels: the
+// length as an unsigned LEB128 varint, then r, g, b and a
+// as one byte each. Runs crossing a row boundary are split
+// in two. A footer holds the byte offset of every row, then
+// the offset of the footer itself, all as 8-byte little
+// endian integers, so a reader can seek to any row. Errors
+// throw std::runtime_error.
+
+// Writes a file run by run, without holding the image
+class RleWriter {
+   private:
+    std::ofstream out;
+    const int w, h;
+    std::vector<uint64_t> row_offsets;
+    uint64_t pos = 0;
+    // Position of the next pixel to write
+    int row = 0, col = 0;
+
+    void put_byte(uint8_t b);
+    void put_varint(uint64_t v);
+    void put_u64(uint64_t v);
+
+   public:
+    RleWriter(const std::string& path, int w, int h);
+
+    // Channels are stored as 8 bits, so values outside
+    // [0, 255] wrap as in a UImage
+    void write_run(int length, const ivec4& colour);
+    // Writes the row index once every pixel is written
+    void finish();
+};
+
+// Reads a file run by run, without holding the image
+class RleReader {
+   private:
+    std::ifstream in;
+    std::vector<uint64_t> row_offsets;
+    // Pixels left before the end of the image
+    int64_t remaining = 0;
+
+    uint8_t get_byte();
+    uint64_t get_varint();
+    uint64_t get_u64();
+
+   public:
+    int w, h;
+
+    explicit RleReader(const std::string& path);
+
+    // Reads the next run, or returns false at the end
+    bool read_run(int& length, ivec4& colour);
+    // Continues reading from the first run of row y.
+    // Throws std::runtime_error if there is no row y.
+    void seek_row(int y);
+};
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include "vec.h"
+
+// Point-wise kernels over spans of n pixels, matching the
+// vec4 methods of the same name. src and dst may be the
+// same span. On x86-64, SSE2 handles one pixel per
+// instruction in every build, and AVX2 two where the CPU
+// has it, checked at run time unless the build targets it.
+// Anything else falls back to the scalar vec4 code.
+void span_add(const ivec4* src, const ivec4* x, ivec4* dst,
+              int n);
+void span_sub(const ivec4* src, const ivec4* x, ivec4* dst,
+              int n);
+// 64-bit versions, e.g. for running sums
+void span_add(const lvec4* src, const lvec4* x, lvec4* dst,
+              int n);
+void span_sub(const lvec4* src, const lvec4* x, lvec4* dst,
+              int n);
+void span_scale(const ivec4* src, ivec4* dst, int n,
+                double c);
+void span_abs(const ivec4* src, ivec4* dst, int n);
+void span_min_zero(const ivec4* src, ivec4* dst, int n);
+void span_hard_clamp(const ivec4* src, ivec4* dst, int n,
+                     double max);
+// Luminance in 8.8 fixed point, truncated towards zero
+void span_luminance_8_8(const ivec4* src, int* dst, int n);
+// Number of leading pixels equal to src[0] in all four
+// channels, for n of at least one
+int span_run_length(const ivec4* src, int n);
+// Sets all n pixels to v
+void span_fill(ivec4* dst, int n, const ivec4& v);
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef STREAMFILTER_H
+#define STREAMFILTER_H
+
+#include <functional>
+#include <vector>
+
+#include "convolve.h"
+
+// Filters an image fed in one row at a time, top to
+// bottom, holding only a ring of k.h rows. Each finished
+// row goes to the sink as soon as the rows below it have
+// arrived, and finish() flushes the last few once the input
+// ends. Output matches the BasicImage filters, including
+// clamping at the edges, so images too large for memory can
+// be filtered between a row reader and a row writer.
+class StreamFilter {
+   public:
+    // Receives each finished row of w pixels, top to
+    // bottom. The row is only valid during the call.
+    using Sink = std::function<void(const ivec4* row)>;
+
+   private:
+    const FlatKernel kernel;
+    const int w;
+    const int r;
+    const double inv_kmag;
+    Sink sink;
+    // Prepared source row y is kept in slot
+    // (y + r) % (2r + 1)
+    std::vector<ivec4> ring;
+    std::vector<const ivec4*> rows;
+    std::vector<ivec4> out;
+    int rows_in = 0;
+    int rows_out = 0;
+
+    ivec4* slot(int y);
+    template <typename T>
+    void push(const vec4<T>* row);
+    void emit_row();
+
+   public:
+    StreamFilter(const Kernel& kernel, int w,
+                 bool normalise, Sink sink);
+
+    void push_row(const ivec4* row);
+    void push_row(const uvec4* row);
+    // Emits the remaining rows, clamping below the last row
+    // pushed
+    void finish();
+};
+
+#endif
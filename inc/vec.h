@@ -1,6 +1,9 @@
 #ifndef VEC_H
 #define VEC_H
 
+#include <algorithm>
+#include <cmath>
+
 #include "lodepng.h"
 
 template <typename T>
@@ -228,6 +231,20 @@ vec4<T> vec4<T>::hsv_to_rgb() const {
 using uvec4 = vec4<unsigned char>;
 using ivec4 = vec4<int>;
 using dvec4 = vec4<double>;
+// Wide sums, e.g. of many ivec4 pixels
+using lvec4 = vec4<long long>;
+
+// Converts between channel types with static_cast, so
+// narrowing to unsigned char wraps like ivec4_to_uvec4
+template <typename U, typename T>
+inline vec4<U> vec4_cast(const vec4<T>& v) {
+    return vec4<U>{
+        static_cast<U>(v.r),
+        static_cast<U>(v.g),
+        static_cast<U>(v.b),
+        static_cast<U>(v.a),
+    };
+}
 
 inline ivec4 uvec4_to_ivec4(const uvec4& v) {
     return ivec4{
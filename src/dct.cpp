@@ -1,29 +1,64 @@
 #include "dct.h"
 
-static constexpr int B_SIZE = 32;
+#include <array>
+#include <numbers>
+#include <stdexcept>
+#include <type_traits>
 
-Dct::Dct(const Image& image)
-    : w{image.w - (image.w % B_SIZE)},
-      h{image.h - (image.h % B_SIZE)},
-      data{static_cast<size_t>(w * h)} {
-    const int bw = w / B_SIZE;
-    const int bh = h / B_SIZE;
-    auto source = std::vector<dvec4>(data.size());
-    for (int j = 0; j < h; j++) {
-        for (int i = 0; i < w; i++) {
-            source[j * w + i] =
-                ivec4_to_dvec4(image.data[j * image.w + i]);
-        }
-    }
-    for (int j = 0; j < bh; j++) {
-        for (int i = 0; i < bw; i++) {
-            encode_block(source, i, j);
-        }
+#include "parallel.h"
+
+// Calls f with the block size as a compile-time constant
+template <typename F>
+static void with_block_size(int block_size, F f) {
+    switch (block_size) {
+        case 8:
+            f(std::integral_constant<int, 8>());
+            break;
+        case 16:
+            f(std::integral_constant<int, 16>());
+            break;
+        case 32:
+            f(std::integral_constant<int, 32>());
+            break;
+        case 64:
+            f(std::integral_constant<int, 64>());
+            break;
+        default:
+            throw std::invalid_argument(
+                "DCT block size must be 8, 16, 32 or 64");
     }
 }
 
-Dct::Dct(const std::vector<ivec4>& data, int w, int h)
-    : w{w}, h{h}, data{data.size()} {
+static int checked_block_size(int block_size) {
+    with_block_size(block_size, [](auto) {});
+    return block_size;
+}
+
+Dct::Dct(const Image& image, int block_size)
+    : block_size{checked_block_size(block_size)},
+      w{image.w - (image.w % block_size)},
+      h{image.h - (image.h % block_size)},
+      data{static_cast<size_t>(w * h)} {
+    const int bw = w / block_size;
+    const int bh = h / block_size;
+    with_block_size(block_size, [&](auto n) {
+        auto f = [&](int bj_begin, int bj_end) {
+            for (int j = bj_begin; j < bj_end; j++) {
+                for (int i = 0; i < bw; i++) {
+                    encode_block<n()>(image, i, j);
+                }
+            }
+        };
+        parallel_for(0, bh, f);
+    });
+}
+
+Dct::Dct(const std::vector<ivec4>& data, int w, int h,
+         int block_size)
+    : block_size{checked_block_size(block_size)},
+      w{w},
+      h{h},
+      data{data.size()} {
     std::transform(data.cbegin(), data.cend(),
                    this->data.begin(), ivec4_to_dvec4);
 }
@@ -32,24 +67,29 @@ Image Dct::dump_image() const {
     auto out = std::vector<ivec4>(data.size());
     std::transform(data.cbegin(), data.cend(), out.begin(),
                    dvec4_to_ivec4);
-    return Image(out, w, h);
+    return Image(std::move(out), w, h);
 }
 
 Image Dct::to_image_decode() const {
-    int bw = w / B_SIZE;
-    int bh = h / B_SIZE;
+    int bw = w / block_size;
+    int bh = h / block_size;
     auto out = std::vector<ivec4>(data.size());
-    for (int j = 0; j < bh; j++) {
-        for (int i = 0; i < bw; i++) {
-            decode_block(out, i, j);
-        }
-    }
-    return Image(out, w, h);
+    with_block_size(block_size, [&](auto n) {
+        auto f = [&](int bj_begin, int bj_end) {
+            for (int j = bj_begin; j < bj_end; j++) {
+                for (int i = 0; i < bw; i++) {
+                    decode_block<n()>(out, i, j);
+                }
+            }
+        };
+        parallel_for(0, bh, f);
+    });
+    return Image(std::move(out), w, h);
 }
 
 const dvec4& Dct::get_px(int bi, int bj, int i,
                          int j) const {
-    return data[(bj * B_SIZE + j) * w + bi * B_SIZE + i];
+    return data[block_idx(bi, bj, i, j)];
 }
 
 dvec4& Dct::get_px(int bi, int bj, int i, int j) {
@@ -57,94 +97,184 @@ dvec4& Dct::get_px(int bi, int bj, int i, int j) {
         const_cast<const Dct*>(this)->get_px(bi, bj, i, j));
 }
 
-static constexpr double SQRT2 = 1.414213;
-static constexpr double PI = 3.141592;
-static constexpr double INV_2_B_SIZE =
-    1.0 / (2.0 * static_cast<double>(B_SIZE));
-static constexpr double NORM =
-    2.0 / static_cast<double>(B_SIZE);
-
 static constexpr double alpha(int i) {
     if (i == 0) {
-        return 1.0 / 1.414213;
+        return 1.0 / std::numbers::sqrt2;
     }
     return 1.0;
 }
 
-static const std::array<double, B_SIZE * B_SIZE>
-gen_cosine() {
-    auto a = std::array<double, B_SIZE * B_SIZE>();
-    for (int j = 0; j < B_SIZE; j++) {
-        for (int i = 0; i < B_SIZE; i++) {
-            a[j * B_SIZE + i] = std::cos(
-                PI * j * (2 * i + 1) * INV_2_B_SIZE);
-        }
+// cos(x) for x in [0, pi / 2] from its Taylor series, as
+// std::cos cannot be used in constant expressions
+static constexpr double constexpr_cos(double x) {
+    double term = 1.0;
+    double sum = 1.0;
+    for (int k = 1; k < 24; k++) {
+        term *= -x * x / ((2 * k - 1) * (2 * k));
+        sum += term;
+    }
+    return sum;
+}
+
+// Butterfly factors 1 / (2 cos((i + 1/2) pi / N)) for the
+// first stage of the length N transforms below
+template <int N>
+static constexpr std::array<double, N / 2> gen_twiddles() {
+    auto a = std::array<double, N / 2>();
+    for (int i = 0; i < N / 2; i++) {
+        double theta = (i + 0.5) * std::numbers::pi /
+                       static_cast<double>(N);
+        a[i] = 0.5 / constexpr_cos(theta);
     }
     return a;
 }
 
-static const std::array<double, B_SIZE * B_SIZE>
-gen_inv_cosine() {
-    auto a = std::array<double, B_SIZE * B_SIZE>();
-    for (int j = 0; j < B_SIZE; j++) {
-        for (int i = 0; i < B_SIZE; i++) {
-            a[j * B_SIZE + i] =
-                alpha(i) * alpha(j) *
-                std::cos(PI * j * (2 * i + 1) *
-                         INV_2_B_SIZE);
+template <int N>
+static constexpr auto twiddles = gen_twiddles<N>();
+
+// Unnormalised DCT-II of the N values at x, in place,
+// X[k] = sum_i x[i] cos(pi (2i + 1) k / 2N), using Lee's
+// recursive factorisation in O(N log N). tmp must hold N
+// values.
+template <int N>
+static void fdct(double* x, double* tmp) {
+    if constexpr (N > 1) {
+        constexpr int half = N / 2;
+        for (int i = 0; i < half; i++) {
+            double a = x[i];
+            double b = x[N - 1 - i];
+            tmp[i] = a + b;
+            tmp[half + i] = (a - b) * twiddles<N>[i];
         }
+        fdct<half>(tmp, x);
+        fdct<half>(tmp + half, x);
+        for (int i = 0; i < half - 1; i++) {
+            x[2 * i] = tmp[i];
+            x[2 * i + 1] =
+                tmp[half + i] + tmp[half + i + 1];
+        }
+        x[N - 2] = tmp[half - 1];
+        x[N - 1] = tmp[N - 1];
     }
-    return a;
 }
 
-static const auto cosine = gen_cosine();
-static const auto inv_cosine = gen_inv_cosine();
+// Unnormalised DCT-III of the N values at x, in place,
+// x[i] = sum_k X[k] cos(pi (2i + 1) k / 2N), which is the
+// transpose of fdct. tmp must hold N values.
+template <int N>
+static void idct(double* x, double* tmp) {
+    if constexpr (N > 1) {
+        constexpr int half = N / 2;
+        tmp[0] = x[0];
+        tmp[half] = x[1];
+        for (int i = 1; i < half; i++) {
+            tmp[i] = x[2 * i];
+            tmp[half + i] = x[2 * i - 1] + x[2 * i + 1];
+        }
+        idct<half>(tmp, x);
+        idct<half>(tmp + half, x);
+        for (int i = 0; i < half; i++) {
+            double a = tmp[i];
+            double b = tmp[half + i] * twiddles<N>[i];
+            x[i] = a + b;
+            x[N - 1 - i] = a - b;
+        }
+    }
+}
+
+template <int N>
+using Block = std::array<double, N * N>;
+
+// Applies a 1D transform to every row and then every column
+// of a row-major block
+template <int N, typename F>
+static void transform_2d(Block<N>& block, F transform) {
+    std::array<double, N> col, tmp;
+    for (int y = 0; y < N; y++) {
+        transform(&block[y * N], tmp.data());
+    }
+    for (int x = 0; x < N; x++) {
+        for (int y = 0; y < N; y++) {
+            col[y] = block[y * N + x];
+        }
+        transform(col.data(), tmp.data());
+        for (int y = 0; y < N; y++) {
+            block[y * N + x] = col[y];
+        }
+    }
+}
+
+static constexpr double dvec4::* CHANNELS[] = {
+    &dvec4::r, &dvec4::g, &dvec4::b};
+
+// Rounds rather than truncates, so that decoding unmodified
+// coefficients gives back the exact source pixels
+static ivec4 round_to_ivec4(const dvec4& v) {
+    return ivec4{
+        static_cast<int>(std::lround(v.r)),
+        static_cast<int>(std::lround(v.g)),
+        static_cast<int>(std::lround(v.b)),
+        static_cast<int>(std::lround(v.a)),
+    };
+}
 
 int Dct::block_idx(int bi, int bj, int i, int j) const {
-    return (bj * B_SIZE + j) * w + bi * B_SIZE + i;
-}
-
-void Dct::encode_block(std::vector<dvec4>& source, int bi,
-                       int bj) {
-    for (int v = 0; v < B_SIZE; v++) {
-        for (int u = 0; u < B_SIZE; u++) {
-            int uv = block_idx(bi, bj, u, v);
-            data[uv] = dvec4::zero;
-            for (int y = 0; y < B_SIZE; y++) {
-                for (int x = 0; x < B_SIZE; x++) {
-                    int xy = block_idx(bi, bj, x, y);
-                    double coeff = cosine[u * B_SIZE + x] *
-                                   cosine[v * B_SIZE + y];
-                    data[uv] = data[uv].add(
-                        source[xy].scale(coeff));
-                }
+    return (bj * block_size + j) * w + bi * block_size + i;
+}
+
+template <int N>
+void Dct::encode_block(const Image& image, int bi, int bj) {
+    constexpr double norm = 2.0 / static_cast<double>(N);
+    Block<N> block;
+    for (auto c : CHANNELS) {
+        for (int y = 0; y < N; y++) {
+            for (int x = 0; x < N; x++) {
+                int src =
+                    (bj * N + y) * image.w + bi * N + x;
+                block[y * N + x] =
+                    ivec4_to_dvec4(image.data[src]).*c;
+            }
+        }
+        transform_2d<N>(block, fdct<N>);
+        for (int v = 0; v < N; v++) {
+            for (int u = 0; u < N; u++) {
+                get_px(bi, bj, u, v).*c =
+                    block[v * N + u] * alpha(u) * alpha(v) *
+                    norm;
             }
-            data[uv] =
-                data[uv].scale(alpha(u) * alpha(v) * NORM);
-            data[uv].a = 255;
+        }
+    }
+    for (int v = 0; v < N; v++) {
+        for (int u = 0; u < N; u++) {
+            get_px(bi, bj, u, v).a = 255;
         }
     }
 }
 
+template <int N>
 void Dct::decode_block(std::vector<ivec4>& out, int bi,
                        int bj) const {
-    for (int y = 0; y < B_SIZE; y++) {
-        for (int x = 0; x < B_SIZE; x++) {
-            auto out_vec = dvec4::zero;
-            for (int v = 0; v < B_SIZE; v++) {
-                for (int u = 0; u < B_SIZE; u++) {
-                    int uv = block_idx(bi, bj, u, v);
-                    double coeff =
-                        inv_cosine[u * B_SIZE + x] *
-                        inv_cosine[v * B_SIZE + y];
-                    out_vec =
-                        out_vec.add(data[uv].scale(coeff));
-                }
+    constexpr double norm = 2.0 / static_cast<double>(N);
+    Block<N> block;
+    auto out_block = std::array<dvec4, N * N>();
+    for (auto c : CHANNELS) {
+        for (int v = 0; v < N; v++) {
+            for (int u = 0; u < N; u++) {
+                block[v * N + u] = get_px(bi, bj, u, v).*c *
+                                   alpha(u) * alpha(v);
             }
-            out_vec.a = 255;
+        }
+        transform_2d<N>(block, idct<N>);
+        for (int i = 0; i < N * N; i++) {
+            out_block[i].*c = block[i] * norm;
+        }
+    }
+    for (int y = 0; y < N; y++) {
+        for (int x = 0; x < N; x++) {
+            auto v = out_block[y * N + x];
+            v.a = 255;
             int xy = block_idx(bi, bj, x, y);
-            out[xy] = dvec4_to_ivec4(out_vec.scale(
-                NORM / (alpha(x) * alpha(y))));
+            out[xy] = round_to_ivec4(v);
         }
     }
 }
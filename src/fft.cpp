@@ -0,0 +1,98 @@
+#include "fft.h"
+
+#include <bit>
+#include <numbers>
+#include <stdexcept>
+
+Fft::Fft(int n) : n{n}, twiddles(n / 2), bit_reverse(n) {
+    if (n <= 0 || !std::has_single_bit(
+                      static_cast<unsigned int>(n))) {
+        throw std::invalid_argument(
+            "FFT length must be a power of two");
+    }
+    for (int k = 0; k < n / 2; k++) {
+        double theta = -2.0 * std::numbers::pi * k / n;
+        twiddles[k] = std::polar(1.0, theta);
+    }
+    int bits =
+        std::countr_zero(static_cast<unsigned int>(n));
+    for (int i = 0; i < n; i++) {
+        int r = 0;
+        for (int b = 0; b < bits; b++) {
+            r |= ((i >> b) & 1) << (bits - 1 - b);
+        }
+        bit_reverse[i] = r;
+    }
+}
+
+// Iterative Cooley-Tukey: bit-reversal permutation, then
+// log2(n) rounds of butterflies over doubling spans
+void Fft::transform(complex* x, bool inverse) const {
+    for (int i = 0; i < n; i++) {
+        int j = bit_reverse[i];
+        if (i < j) {
+            std::swap(x[i], x[j]);
+        }
+    }
+    for (int len = 2; len <= n; len *= 2) {
+        const int half = len / 2;
+        const int step = n / len;
+        for (int i = 0; i < n; i += len) {
+            for (int k = 0; k < half; k++) {
+                complex w = twiddles[k * step];
+                if (inverse) {
+                    w = std::conj(w);
+                }
+                complex u = x[i + k];
+                complex v = x[i + k + half] * w;
+                x[i + k] = u + v;
+                x[i + k + half] = u - v;
+            }
+        }
+    }
+    if (inverse) {
+        const double inv_n = 1.0 / n;
+        for (int i = 0; i < n; i++) {
+            x[i] *= inv_n;
+        }
+    }
+}
+
+void Fft::forward(complex* x) const { transform(x, false); }
+
+void Fft::inverse(complex* x) const { transform(x, true); }
+
+// Rows in place, then each column through a contiguous
+// copy
+static void transform_2d(const Fft& fft, Fft::complex* x,
+                         bool inverse) {
+    const int n = fft.n;
+    auto run = [&](Fft::complex* v) {
+        if (inverse) {
+            fft.inverse(v);
+        } else {
+            fft.forward(v);
+        }
+    };
+    for (int y = 0; y < n; y++) {
+        run(&x[y * n]);
+    }
+    std::vector<Fft::complex> col(n);
+    for (int i = 0; i < n; i++) {
+        for (int y = 0; y < n; y++) {
+            col[y] = x[y * n + i];
+        }
+        run(col.data());
+        for (int y = 0; y < n; y++) {
+            x[y * n + i] = col[y];
+        }
+    }
+}
+
+void Fft::forward_2d(complex* x) const {
+    transform_2d(*this, x, false);
+}
+
+void Fft::inverse_2d(complex* x) const {
+    transform_2d(*this, x, true);
+}
@@ -1,29 +1,94 @@
 #include "image.h"
 
-Image::Image(int w, int h)
+#include <bit>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include "convolve.h"
+#include "fft.h"
+#include "parallel.h"
+#include "pointwise.h"
+#include "simd.h"
+
+// Minimum work per thread in rows or columns for loops over
+// bands, alongside PX_GRAIN for point-wise loops
+static constexpr int ROW_GRAIN = 16;
+static constexpr int COL_GRAIN = 64;
+// Non-separable kernels with more taps than this, i.e.
+// larger than 15 x 15, are applied through the FFT
+static constexpr int FFT_MIN_TAPS = 15 * 15;
+
+// Largest box_blur radius for channels of type T. Its
+// running sums cover up to 2r + 2 rows of 2r + 2 pixels
+// before the trailing one is dropped, which must fit in 64
+// bits for any channel values.
+template <typename T>
+static constexpr int max_box_radius() {
+    using limits = std::numeric_limits<T>;
+    constexpr long long most =
+        std::max(-static_cast<long long>(limits::min()),
+                 static_cast<long long>(limits::max()));
+    constexpr long long bound =
+        std::numeric_limits<long long>::max() / most;
+    // Largest side with side * side <= bound, starting
+    // from the square root of the 64-bit maximum
+    long long lo = 1, hi = 3037000499;
+    while (lo < hi) {
+        long long mid = (lo + hi + 1) / 2;
+        if (mid * mid <= bound) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return (lo - 2) / 2;
+}
+
+template <typename T>
+BasicImage<T>::BasicImage(int w, int h)
     : w{w}, h{h}, data{static_cast<size_t>(w * h)} {}
 
-Image::Image(const std::vector<ivec4>& data, int w, int h)
-    : w{w}, h{h}, data{data} {}
+template <typename T>
+BasicImage<T>::BasicImage(const std::vector<ivec4>& data,
+                          int w, int h)
+    : w{w}, h{h}, data{data.size()} {
+    std::transform(data.cbegin(), data.cend(),
+                   this->data.begin(), vec4_cast<T, int>);
+}
 
-Image::Image(const std::vector<uvec4>& data, int w, int h)
+template <typename T>
+BasicImage<T>::BasicImage(const std::vector<uvec4>& data,
+                          int w, int h)
     : w{w}, h{h}, data{data.size()} {
     std::transform(data.cbegin(), data.cend(),
-                   this->data.begin(), uvec4_to_ivec4);
+                   this->data.begin(),
+                   vec4_cast<T, unsigned char>);
 }
 
-const ivec4& Image::get_px(int x, int y) const {
+template <typename T>
+BasicImage<T>::BasicImage(std::vector<vec4<T>>&& data,
+                          int w, int h)
+    : w{w}, h{h}, data{std::move(data)} {}
+
+template <typename T>
+const vec4<T>& BasicImage<T>::get_px(int x, int y) const {
     x = std::clamp(x, 0, w - 1);
     y = std::clamp(y, 0, h - 1);
     return data[y * w + x];
 }
 
-ivec4& Image::get_px(int x, int y) {
-    return const_cast<ivec4&>(
-        const_cast<const Image*>(this)->get_px(x, y));
+template <typename T>
+vec4<T>& BasicImage<T>::get_px(int x, int y) {
+    invalidate_luminance();
+    return const_cast<vec4<T>&>(
+        const_cast<const BasicImage*>(this)->get_px(x, y));
 }
 
-void Image::set_px(int x, int y, const ivec4& v) {
+template <typename T>
+void BasicImage<T>::set_px(int x, int y, const vec4<T>& v) {
+    invalidate_luminance();
     size_t i = y * w + x;
     data[i].r = v.r;
     data[i].g = v.g;
@@ -31,333 +96,693 @@ void Image::set_px(int x, int y, const ivec4& v) {
     data[i].a = v.a;
 }
 
-Image Image::duplicate() const { return Image(data, w, h); }
-
-#define POSTERISATION_LEVELS 8
-#define POSTERISATION_COEFF \
-    (unsigned char)(256 / POSTERISATION_LEVELS)
+template <typename T>
+BasicImage<T> BasicImage<T>::duplicate() const {
+    return *this;
+}
 
-unsigned char posterise_value(unsigned char v) {
-    if (v == 255) {
-        return v;
+template <typename T>
+const std::vector<int>& BasicImage<T>::luminance() const {
+    if (!lum_cache.empty() || data.empty()) {
+        return lum_cache;
     }
-    return (v / POSTERISATION_COEFF) * POSTERISATION_COEFF;
-}
-
-Image& Image::posterise(bool ignore_alpha = true) {
-    std::vector<ivec4> out(data.size());
-    for (size_t i = 0; i < data.size(); i++) {
-        const auto& v_o = data[i];
-        auto& v_t = out[i];
-        v_t.r = posterise_value(v_o.r);
-        v_t.g = posterise_value(v_o.g);
-        v_t.b = posterise_value(v_o.b);
-        if (ignore_alpha) {
-            v_t.a = v_o.a;
+    lum_cache.resize(data.size());
+    auto f = [&](int begin, int end) {
+        if constexpr (std::is_same_v<T, int>) {
+            span_luminance_8_8(&data[begin],
+                               &lum_cache[begin],
+                               end - begin);
         } else {
-            v_t.a = posterise_value(v_o.a);
+            // Widens a chunk at a time for the kernel
+            std::array<ivec4, 256> tmp;
+            for (int i = begin; i < end; i += tmp.size()) {
+                int n = std::min<int>(tmp.size(), end - i);
+                std::transform(data.data() + i,
+                               data.data() + i + n,
+                               tmp.begin(),
+                               vec4_cast<int, T>);
+                span_luminance_8_8(tmp.data(),
+                                   &lum_cache[i], n);
+            }
         }
-    }
-    data = std::move(out);
-    return *this;
+    };
+    parallel_for(0, data.size(), f, PX_GRAIN);
+    return lum_cache;
+}
+
+// Frees the storage as well, so an image only holds the
+// extra 4 bytes per pixel while the cache is valid
+template <typename T>
+void BasicImage<T>::invalidate_luminance() {
+    std::vector<int>().swap(lum_cache);
+}
+
+// Runs a span kernel f(pixels, n) over an Image's pixels,
+// with contiguous ranges spread across threads
+template <typename F>
+void for_each_span(std::vector<ivec4>& data, F f) {
+    auto g = [&](int begin, int end) {
+        f(&data[begin], end - begin);
+    };
+    parallel_for(0, data.size(), g, PX_GRAIN);
+}
+
+template <typename T>
+BasicImage<T>& BasicImage<T>::posterise(bool ignore_alpha) {
+    return map(PosteriseOp{ignore_alpha});
 }
 
 double get_streak_len(double lum) {
     return pow(lum / 256.0, 2.0) * 10;
 }
 
-Image& Image::streak(
-    const std::vector<int> h_iter,
-    const std::vector<int> v_iter,
-    const std::function<std::optional<int>(int, int, int,
-                                           int, int)>
-        get_streak_idx,
-    const std::function<int(const ivec4&)> measure,
-    const std::optional<Image>& measure_source) {
-    std::vector<ivec4> out(data.size());
-    for (int j : v_iter) {
-        for (int i : h_iter) {
-            int idx = j * w + i;
-            const auto& v_o = data[idx];
-            auto v_m = data[idx];
-            if (measure_source.has_value()) {
-                v_m = measure_source.value().data[idx];
+// Streak directions. Vertical streaks run down or up a
+// column and horizontal ones along a row, towards higher
+// indices when forward.
+struct StreakDown {
+    static constexpr bool vertical = true;
+    static constexpr bool forward = true;
+};
+
+struct StreakUp {
+    static constexpr bool vertical = true;
+    static constexpr bool forward = false;
+};
+
+struct StreakLeft {
+    static constexpr bool vertical = false;
+    static constexpr bool forward = false;
+};
+
+struct StreakRight {
+    static constexpr bool vertical = false;
+    static constexpr bool forward = true;
+};
+
+// Truncated luminance of the pixel at an index, read from
+// a cached luminance plane
+struct LuminanceMeasure {
+    const std::vector<int>& lum;
+
+    int operator()(int idx) const { return lum[idx] / 256; }
+};
+
+// Every pixel is smeared over the next streak_len pixels in
+// the streak direction. Pixels are visited against that
+// direction, so a nearer pixel overwrites the tails of
+// streaks from pixels further back. This runs in place, as
+// a pixel is read before anything is written over it. A
+// streak never leaves its column or row, so bands of
+// columns (or rows) run on separate threads with the same
+// result as a serial pass.
+template <typename T>
+template <typename Dir, typename Measure>
+BasicImage<T>& BasicImage<T>::streak(Measure measure) {
+    constexpr int step = Dir::forward ? 1 : -1;
+    const int len = Dir::vertical ? h : w;
+    // One past the last position covered by the streak
+    // starting at position p of its line
+    auto streak_end = [&](int p, int idx) {
+        int s_len = get_streak_len(measure(idx));
+        s_len = std::max(1, s_len);
+        return Dir::forward ? std::min(len, p + s_len)
+                            : std::max(-1, p - s_len);
+    };
+    if constexpr (Dir::vertical) {
+        auto f = [&](int i_begin, int i_end) {
+            for (int n = 0; n < h; n++) {
+                int j = Dir::forward ? h - 1 - n : n;
+                for (int i = i_begin; i < i_end; i++) {
+                    int idx = j * w + i;
+                    int end = streak_end(j, idx);
+                    auto v = data[idx];
+                    for (int y = j; y != end; y += step) {
+                        data[y * w + i] = v;
+                    }
+                }
             }
-            unsigned char streak_len =
-                get_streak_len(measure(v_m));
-            streak_len = std::max(
-                static_cast<unsigned char>(1),
-                static_cast<unsigned char>(streak_len));
-            for (int k = 0; k < streak_len; k++) {
-                std::optional<int> s_idx_op =
-                    get_streak_idx(w, h, i, j, k);
-                if (not s_idx_op.has_value()) {
-                    break;
+        };
+        parallel_for(0, w, f, COL_GRAIN);
+    } else {
+        auto f = [&](int j_begin, int j_end) {
+            for (int j = j_begin; j < j_end; j++) {
+                for (int n = 0; n < w; n++) {
+                    int i = Dir::forward ? w - 1 - n : n;
+                    int idx = j * w + i;
+                    int end = streak_end(i, idx);
+                    auto v = data[idx];
+                    for (int x = i; x != end; x += step) {
+                        data[j * w + x] = v;
+                    }
                 }
-                int s_idx = s_idx_op.value();
-                out[s_idx] = v_o;
             }
-        }
+        };
+        parallel_for(0, h, f, ROW_GRAIN);
     }
-    data = std::move(out);
+    invalidate_luminance();
     return *this;
 }
 
-Image& Image::streak_down(
-    const std::optional<Image>& measure_source) {
-    auto h_iter = std::vector<int>(w);
-    auto v_iter = std::vector<int>(h);
-    std::iota(h_iter.begin(), h_iter.end(), 0);
-    std::iota(v_iter.rbegin(), v_iter.rend(), 0);
-    auto get_streak_pos = [](int w, int h, int i, int j,
-                             int k) -> std::optional<int> {
-        if (j + k >= h) {
-            return std::nullopt;
-        }
-        return (j + k) * w + i;
-    };
-    auto measure = [](const ivec4& v) {
-        return v.luminance();
-    };
-    return streak(h_iter, v_iter, get_streak_pos, measure,
-                  measure_source);
-}
-
-Image& Image::streak_up(
-    const std::optional<Image>& measure_source) {
-    auto h_iter = std::vector<int>(w);
-    auto v_iter = std::vector<int>(h);
-    std::iota(h_iter.begin(), h_iter.end(), 0);
-    std::iota(v_iter.begin(), v_iter.end(), 0);
-    auto get_streak_pos = [](int w, int h [[gnu::unused]],
-                             int i, int j,
-                             int k) -> std::optional<int> {
-        if (j - k < 0) {
-            return std::nullopt;
-        }
-        return (j - k) * w + i;
-    };
-    auto measure = [](const ivec4& v) {
-        return v.luminance();
-    };
-    return streak(h_iter, v_iter, get_streak_pos, measure,
-                  measure_source);
-}
-
-Image& Image::streak_left(
-    const std::optional<Image>& measure_source) {
-    auto h_iter = std::vector<int>(w);
-    auto v_iter = std::vector<int>(h);
-    std::iota(h_iter.begin(), h_iter.end(), 0);
-    std::iota(v_iter.begin(), v_iter.end(), 0);
-    auto get_streak_pos = [](int w, int h [[gnu::unused]],
-                             int i, int j,
-                             int k) -> std::optional<int> {
-        if (i - k < 0) {
-            return std::nullopt;
-        }
-        return j * w + i - k;
-    };
-    auto measure = [](const ivec4& v) {
-        return v.luminance();
-    };
-    return streak(h_iter, v_iter, get_streak_pos, measure,
-                  measure_source);
-}
-
-Image& Image::streak_right(
-    const std::optional<Image>& measure_source) {
-    auto h_iter = std::vector<int>(w);
-    auto v_iter = std::vector<int>(h);
-    std::iota(h_iter.rbegin(), h_iter.rend(), 0);
-    std::iota(v_iter.begin(), v_iter.end(), 0);
-    auto get_streak_pos = [](int w, int h [[gnu::unused]],
-                             int i, int j,
-                             int k) -> std::optional<int> {
-        if (i + k >= w) {
-            return std::nullopt;
-        }
-        return j * w + i + k;
-    };
-    auto measure = [](const ivec4& v) {
-        return v.luminance();
-    };
-    return streak(h_iter, v_iter, get_streak_pos, measure,
-                  measure_source);
+template <typename T>
+BasicImage<T>& BasicImage<T>::streak_down(
+    const std::optional<BasicImage>& measure_source) {
+    const auto& src =
+        measure_source ? *measure_source : *this;
+    return streak<StreakDown>(
+        LuminanceMeasure{src.luminance()});
 }
 
-Image& Image::apply_function(
-    const std::function<ivec4(ivec4&)> f) {
-    std::transform(data.begin(), data.end(), data.begin(),
-                   f);
-    return *this;
+template <typename T>
+BasicImage<T>& BasicImage<T>::streak_up(
+    const std::optional<BasicImage>& measure_source) {
+    const auto& src =
+        measure_source ? *measure_source : *this;
+    return streak<StreakUp>(
+        LuminanceMeasure{src.luminance()});
+}
+
+template <typename T>
+BasicImage<T>& BasicImage<T>::streak_left(
+    const std::optional<BasicImage>& measure_source) {
+    const auto& src =
+        measure_source ? *measure_source : *this;
+    return streak<StreakLeft>(
+        LuminanceMeasure{src.luminance()});
 }
 
-Image& Image::add(const Image& other, double other_ratio) {
-    std::vector<ivec4> out(data.size());
-    for (size_t i = 0; i < data.size(); i++) {
-        out[i] = (data[i].scale(1.0 - other_ratio))
-                     .add(other.data[i].scale(other_ratio));
+template <typename T>
+BasicImage<T>& BasicImage<T>::streak_right(
+    const std::optional<BasicImage>& measure_source) {
+    const auto& src =
+        measure_source ? *measure_source : *this;
+    return streak<StreakRight>(
+        LuminanceMeasure{src.luminance()});
+}
+
+template <typename T>
+BasicImage<T>& BasicImage<T>::apply_function(
+    const std::function<ivec4(ivec4&)> f) {
+    return map([&](ivec4 v) { return f(v); });
+}
+
+template <typename T>
+BasicImage<T>& BasicImage<T>::add(const BasicImage& other,
+                                  double other_ratio) {
+    if constexpr (std::is_same_v<T, int>) {
+        // Scales the other image a chunk at a time into a
+        // small buffer, then scales and accumulates in
+        // place. other may be this image, as each chunk of
+        // it is read before the chunk is overwritten.
+        auto f = [&](int begin, int end) {
+            std::array<ivec4, 256> tmp;
+            for (int i = begin; i < end; i += tmp.size()) {
+                int n = std::min<int>(tmp.size(), end - i);
+                span_scale(&other.data[i], tmp.data(), n,
+                           other_ratio);
+                span_scale(&data[i], &data[i], n,
+                           1.0 - other_ratio);
+                span_add(&data[i], tmp.data(), &data[i], n);
+            }
+        };
+        parallel_for(0, data.size(), f, PX_GRAIN);
+    } else {
+        auto f = [&](int begin, int end) {
+            for (int i = begin; i < end; i++) {
+                auto v = vec4_cast<int>(data[i]);
+                auto o = vec4_cast<int>(other.data[i]);
+                data[i] = vec4_cast<T>(
+                    v.scale(1.0 - other_ratio)
+                        .add(o.scale(other_ratio)));
+            }
+        };
+        parallel_for(0, data.size(), f, PX_GRAIN);
     }
-    data = std::move(out);
+    invalidate_luminance();
     return *this;
 }
 
-Image& Image::half_size() {
+template <typename T>
+BasicImage<T>& BasicImage<T>::half_size() {
     int hw = w / 2, hh = h / 2;
-    std::vector<ivec4> out(hw * hh);
-    for (int j = 0; j < hh; j++) {
-        for (int i = 0; i < hw; i++) {
-            ivec4& tl = data[(2 * j) * w + (2 * i)];
-            ivec4& tr = data[(2 * j) * w + (2 * i + 1)];
-            ivec4& bl = data[(2 * j + 1) * w + (2 * i)];
-            ivec4& br = data[(2 * j + 1) * w + (2 * i + 1)];
-            out[j * hw + i] =
-                tl.add(tr).add(bl).add(br).scale(0.25);
+    std::vector<vec4<T>> out(hw * hh);
+    auto px = [&](int x, int y) {
+        return vec4_cast<int>(data[y * w + x]);
+    };
+    auto f = [&](int j_begin, int j_end) {
+        for (int j = j_begin; j < j_end; j++) {
+            for (int i = 0; i < hw; i++) {
+                ivec4 tl = px(2 * i, 2 * j);
+                ivec4 tr = px(2 * i + 1, 2 * j);
+                ivec4 bl = px(2 * i, 2 * j + 1);
+                ivec4 br = px(2 * i + 1, 2 * j + 1);
+                out[j * hw + i] = vec4_cast<T>(
+                    tl.add(tr).add(bl).add(br).scale(0.25));
+            }
         }
-    }
+    };
+    parallel_for(0, hh, f, ROW_GRAIN);
     w = hw;
     h = hh;
     data = std::move(out);
+    invalidate_luminance();
     return *this;
 }
 
-Image& Image::abs() {
-    auto f = [](ivec4& v) { return v.abs(); };
-    return apply_function(f);
+template <typename T>
+BasicImage<T>& BasicImage<T>::abs() {
+    if constexpr (std::is_same_v<T, int>) {
+        for_each_span(data, [](ivec4* px, int n) {
+            span_abs(px, px, n);
+        });
+        invalidate_luminance();
+        return *this;
+    }
+    return map(AbsOp{});
 }
 
-Image& Image::clamp_zero() {
-    auto f = [](ivec4& v) { return v.min_zero(); };
-    return apply_function(f);
+template <typename T>
+BasicImage<T>& BasicImage<T>::clamp_zero() {
+    if constexpr (std::is_same_v<T, int>) {
+        for_each_span(data, [](ivec4* px, int n) {
+            span_min_zero(px, px, n);
+        });
+        invalidate_luminance();
+        return *this;
+    }
+    return map(ClampZeroOp{});
 }
 
-Image& Image::hard_clamp(double max) {
-    auto f = [max](ivec4& v) { return v.hard_clamp(max); };
-    return apply_function(f);
+template <typename T>
+BasicImage<T>& BasicImage<T>::hard_clamp(double max) {
+    if constexpr (std::is_same_v<T, int>) {
+        for_each_span(data, [max](ivec4* px, int n) {
+            span_hard_clamp(px, px, n, max);
+        });
+        invalidate_luminance();
+        return *this;
+    }
+    return map(HardClampOp{max});
 }
 
-Image& Image::smooth_clamp(double half, double max) {
-    auto f = [half, max](ivec4& v) {
-        return v.smooth_clamp(half, max);
-    };
-    return apply_function(f);
+template <typename T>
+BasicImage<T>& BasicImage<T>::smooth_clamp(double half,
+                                           double max) {
+    return map(SmoothClampOp{half, max});
 }
 
-Image& Image::modulo(int mod) {
-    auto f = [mod](ivec4& v) { return v.modulo(mod); };
-    return apply_function(f);
+template <typename T>
+BasicImage<T>& BasicImage<T>::modulo(int mod) {
+    return map(ModuloOp{mod});
 }
 
-Image& Image::scale(double c) {
-    auto f = [c](ivec4& v) { return v.scale(c); };
-    return apply_function(f);
+template <typename T>
+BasicImage<T>& BasicImage<T>::scale(double c) {
+    if constexpr (std::is_same_v<T, int>) {
+        for_each_span(data, [c](ivec4* px, int n) {
+            span_scale(px, px, n, c);
+        });
+        invalidate_luminance();
+        return *this;
+    }
+    return map(ScaleOp{c});
 }
 
-Image& Image::remove_red() {
-    auto f = [](ivec4& v) {
-        v.r = 0;
-        return v;
-    };
-    return apply_function(f);
+template <typename T>
+BasicImage<T>& BasicImage<T>::remove_red() {
+    return map(RemoveRedOp{});
 }
 
-Image& Image::remove_green() {
-    auto f = [](ivec4& v) {
-        v.g = 0;
-        return v;
-    };
-    return apply_function(f);
+template <typename T>
+BasicImage<T>& BasicImage<T>::remove_green() {
+    return map(RemoveGreenOp{});
 }
 
-Image& Image::remove_blue() {
-    auto f = [](ivec4& v) {
-        v.b = 0;
-        return v;
-    };
-    return apply_function(f);
+template <typename T>
+BasicImage<T>& BasicImage<T>::remove_blue() {
+    return map(RemoveBlueOp{});
 }
 
-Image& Image::black_and_white() {
-    auto f = [](ivec4& v) {
-        int lum = static_cast<int>(v.luminance());
-        return vec4{lum, lum, lum, 255};
+template <typename T>
+BasicImage<T>& BasicImage<T>::black_and_white() {
+    const auto& lum_plane = luminance();
+    auto f = [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            int lum = lum_plane[i] / 256;
+            data[i] =
+                vec4_cast<T>(ivec4{lum, lum, lum, 255});
+        }
     };
-    return apply_function(f);
+    parallel_for(0, data.size(), f, PX_GRAIN);
+    invalidate_luminance();
+    return *this;
 }
 
-Image& Image::rgb_to_hsv() {
-    auto f = [](ivec4& v) { return v.rgb_to_hsv(); };
-    return apply_function(f);
+template <typename T>
+BasicImage<T>& BasicImage<T>::rgb_to_hsv() {
+    return map(RgbToHsvOp{});
 }
 
-Image& Image::hsv_to_rgb() {
-    auto f = [](ivec4& v) { return v.hsv_to_rgb(); };
-    return apply_function(f);
+template <typename T>
+BasicImage<T>& BasicImage<T>::hsv_to_rgb() {
+    return map(HsvToRgbOp{});
 }
 
 #include <numeric>
 
-Image& Image::apply_filter(const Kernel& k,
-                           bool normalise) {
-    auto out = std::vector<ivec4>(w * h);
-    for (int j = 0; j < h; j++) {
-        for (int i = 0; i < w; i++) {
-            int idx = j * w + i;
-            out[idx] = ivec4::zero;
-            for (int kj = 0; kj < k.h; kj++) {
-                for (int ki = 0; ki < k.w; ki++) {
-                    int kx = i + ki - k.w / 2;
-                    int ky = j + kj - k.h / 2;
-                    out[idx] =
-                        out[idx].add(get_px(kx, ky).scale(
-                            k.get_px(ki, kj)));
+// Filters an image in place, where result row j depends on
+// source rows j - r to j + r, clamped to the image. Each
+// thread works down a band of rows. prep(src, dst) turns
+// each source row into a widened row of a ring of 2r + 1,
+// and emit(rows, out) writes a result row from the ring's
+// rows in order. Rows just outside each band are copied
+// before any band is written, and rows inside it are read
+// before they are overwritten, so only the ring and the
+// halo copies are allocated.
+template <typename T, typename Prep, typename Emit>
+static void filter_rows(std::vector<vec4<T>>& data, int w,
+                        int h, int r, Prep prep,
+                        Emit emit) {
+    const int kh = 2 * r + 1;
+    const int n_bands =
+        std::clamp(h / ROW_GRAIN, 1, get_num_threads());
+    auto band_start = [&](int b) {
+        return static_cast<int>(static_cast<long long>(h) *
+                                b / n_bands);
+    };
+    auto halo = std::vector<vec4<T>>(n_bands * 2 * r * w);
+    auto halo_row = [&](int b, int k) {
+        return &halo[(b * 2 * r + k) * w];
+    };
+    for (int b = 0; b < n_bands; b++) {
+        for (int k = 0; k < r; k++) {
+            int above =
+                std::clamp(band_start(b) - r + k, 0, h - 1);
+            int below =
+                std::clamp(band_start(b + 1) + k, 0, h - 1);
+            std::copy_n(&data[above * w], w,
+                        halo_row(b, k));
+            std::copy_n(&data[below * w], w,
+                        halo_row(b, r + k));
+        }
+    }
+    auto f = [&](int b_begin, int b_end) {
+        auto ring = std::vector<ivec4>(kh * w);
+        auto rows = std::vector<const ivec4*>(kh);
+        for (int b = b_begin; b < b_end; b++) {
+            int start = band_start(b);
+            int end = band_start(b + 1);
+            // Row y of the source goes to ring slot
+            // (y + r) % kh, where y is at least -r
+            auto load = [&](int y) {
+                int yc = std::clamp(y, 0, h - 1);
+                const vec4<T>* src;
+                if (yc >= start && yc < end) {
+                    src = &data[yc * w];
+                } else if (y < start) {
+                    src = halo_row(b, y - (start - r));
+                } else {
+                    src = halo_row(b, r + y - end);
+                }
+                prep(src, &ring[(y + r) % kh * w]);
+            };
+            for (int y = start - r; y < start + r; y++) {
+                load(y);
+            }
+            for (int j = start; j < end; j++) {
+                load(j + r);
+                for (int k = 0; k < kh; k++) {
+                    rows[k] = &ring[(j + k) % kh * w];
                 }
+                emit(rows.data(), &data[j * w]);
             }
-            out[idx].a = 255;
         }
+    };
+    parallel_for(0, n_bands, f);
+}
+
+// Separable kernels apply their row factor as rows enter
+// the ring and their column factor on the way out, and
+// other kernels the direct 2D sum on the way out
+template <typename T>
+BasicImage<T>& BasicImage<T>::apply_filter(const Kernel& k,
+                                           bool normalise) {
+    if (!k.separable() && k.w * k.h > FFT_MIN_TAPS) {
+        return apply_fft_filter(k, normalise);
     }
-    if (normalise) {
-        double kmag = static_cast<double>(k.abs_mag());
-        for (ivec4& v : out) {
-            v = v.scale(1.0 / kmag);
+    double inv_kmag = normalise ? 1.0 / k.abs_mag() : 0.0;
+    const FlatKernel flat(k);
+    auto prep = [&](const vec4<T>* src, ivec4* dst) {
+        filter_prep_row(flat, src, w, dst);
+    };
+    auto emit = [&](const ivec4* const* rows,
+                    vec4<T>* out) {
+        filter_emit_row(flat, rows, w, inv_kmag, out);
+    };
+    filter_rows(data, w, h, k.h / 2, prep, emit);
+    invalidate_luminance();
+    return *this;
+}
+
+// Correlates each tile of the image with the kernel as a
+// product of 2D FFTs, using overlap-save: the FFT input is
+// the tile plus a kernel-sized margin of source pixels,
+// read with edges clamped, and the part of the circular
+// convolution that did not wrap around is kept. Red and
+// green share one complex transform as its real and
+// imaginary parts. Sums are rounded to integers, which
+// matches direct convolution unless the values are large
+// enough for FFT rounding error to reach 0.5.
+template <typename T>
+BasicImage<T>& BasicImage<T>::apply_fft_filter(
+    const Kernel& k, bool normalise) {
+    using complex = Fft::complex;
+    double inv_kmag = normalise ? 1.0 / k.abs_mag() : 0.0;
+    const Fft fft(static_cast<int>(
+        std::bit_ceil(2u * std::max(k.w, k.h))));
+    const int n = fft.n;
+    const int tile_w = n - k.w + 1;
+    const int tile_h = n - k.h + 1;
+    // The kernel flipped, so that convolution with it
+    // gives the correlation apply_filter computes
+    auto k_freq = std::vector<complex>(n * n);
+    for (int kj = 0; kj < k.h; kj++) {
+        for (int ki = 0; ki < k.w; ki++) {
+            int idx = (k.h - 1 - kj) * n + k.w - 1 - ki;
+            k_freq[idx] = k.get_px(ki, kj);
         }
     }
+    fft.forward_2d(k_freq.data());
+    auto out = std::vector<vec4<T>>(data.size());
+    auto f = [&](int tj_begin, int tj_end) {
+        auto rg = std::vector<complex>(n * n);
+        auto b = std::vector<complex>(n * n);
+        for (int tj = tj_begin; tj < tj_end; tj++) {
+            int y0 = tj * tile_h;
+            for (int x0 = 0; x0 < w; x0 += tile_w) {
+                for (int q = 0; q < n * n; q++) {
+                    int x = x0 - k.w / 2 + q % n;
+                    int y = y0 - k.h / 2 + q / n;
+                    // Through the const overload, which
+                    // leaves the luminance cache alone
+                    auto v = vec4_cast<int>(
+                        std::as_const(*this).get_px(x, y));
+                    rg[q] = complex(v.r, v.g);
+                    b[q] = v.b;
+                }
+                fft.forward_2d(rg.data());
+                fft.forward_2d(b.data());
+                for (int q = 0; q < n * n; q++) {
+                    rg[q] *= k_freq[q];
+                    b[q] *= k_freq[q];
+                }
+                fft.inverse_2d(rg.data());
+                fft.inverse_2d(b.data());
+                int th = std::min(tile_h, h - y0);
+                int tw = std::min(tile_w, w - x0);
+                for (int ty = 0; ty < th; ty++) {
+                    for (int tx = 0; tx < tw; tx++) {
+                        int q = (ty + k.h - 1) * n + tx +
+                                k.w - 1;
+                        auto acc = ivec4{
+                            static_cast<int>(
+                                std::lround(rg[q].real())),
+                            static_cast<int>(
+                                std::lround(rg[q].imag())),
+                            static_cast<int>(
+                                std::lround(b[q].real())),
+                            0};
+                        int idx = (y0 + ty) * w + x0 + tx;
+                        out[idx] = vec4_cast<T>(
+                            finish_filter(acc, inv_kmag));
+                    }
+                }
+            }
+        }
+    };
+    parallel_for(0, (h + tile_h - 1) / tile_h, f);
     data = std::move(out);
+    invalidate_luminance();
     return *this;
 }
 
-Image& Image::sobel_horizontal(bool normalise) {
-    auto k = std::vector<int>{-1, 0, 1, -2, 0, 2, -1, 0, 1};
-    return apply_filter(Kernel(k, 3, 3), normalise);
-}
-
-Image& Image::sobel_vertical(bool normalise) {
-    auto k = std::vector<int>{-1, -2, -1, 0, 0, 0, 1, 2, 1};
-    return apply_filter(Kernel(k, 3, 3), normalise);
-}
-
-Image& Image::laplacian3(bool normalise) {
-    auto k =
-        std::vector<int>{-1, -1, -1, -1, 8, -1, -1, -1, -1};
-    return apply_filter(Kernel(k, 3, 3), normalise);
+// apply_filter for a kernel known at compile time
+template <typename T>
+template <auto K>
+BasicImage<T>& BasicImage<T>::apply_fixed_filter(
+    bool normalise) {
+    constexpr double inv_k = 1.0 / K.abs_mag();
+    double inv_kmag = normalise ? inv_k : 0.0;
+    auto prep = [&](const vec4<T>* src, ivec4* dst) {
+        fixed_prep_row<K>(src, w, dst);
+    };
+    auto emit = [&](const ivec4* const* rows,
+                    vec4<T>* out) {
+        fixed_emit_row<K>(rows, w, inv_kmag, out);
+    };
+    filter_rows(data, w, h, K.h / 2, prep, emit);
+    invalidate_luminance();
+    return *this;
 }
 
-Image& Image::laplacian5(bool normalise) {
-    auto k = std::vector<int>{
-        0,  0,  -1, 0,  0,  0,  -1, -2, -1, 0,  -1, -2, 16,
-        -2, -1, 0,  -1, -2, -1, 0,  0,  0,  -1, 0,  0};
-    return apply_filter(Kernel(k, 5, 5), normalise);
+static constexpr auto SOBEL_HORIZONTAL =
+    FixedSeparableKernel<3, 3>{{-1, 0, 1}, {1, 2, 1}};
+static constexpr auto SOBEL_VERTICAL =
+    FixedSeparableKernel<3, 3>{{1, 2, 1}, {-1, 0, 1}};
+static constexpr auto LAPLACIAN3 = FixedKernel<3, 3>{
+    {-1, -1, -1, -1, 8, -1, -1, -1, -1}};
+static constexpr auto LAPLACIAN5 = FixedKernel<5, 5>{
+    {0,  0,  -1, 0,  0,  0,  -1, -2, -1, 0,  -1, -2, 16,
+     -2, -1, 0,  -1, -2, -1, 0,  0,  0,  -1, 0,  0}};
+static constexpr auto BOX =
+    FixedSeparableKernel<3, 3>{{1, 1, 1}, {1, 1, 1}};
+static constexpr auto GAUSSIAN = FixedKernel<5, 5>{
+    {1,  4, 7, 4,  1,  4,  16, 26, 16, 4, 7, 26, 41,
+     26, 7, 4, 16, 26, 16, 4,  1,  4,  7, 4, 1}};
+
+template <typename T>
+BasicImage<T>& BasicImage<T>::sobel_horizontal(
+    bool normalise) {
+    return apply_fixed_filter<SOBEL_HORIZONTAL>(normalise);
+}
+
+template <typename T>
+BasicImage<T>& BasicImage<T>::sobel_vertical(
+    bool normalise) {
+    return apply_fixed_filter<SOBEL_VERTICAL>(normalise);
+}
+
+template <typename T>
+BasicImage<T>& BasicImage<T>::laplacian3(bool normalise) {
+    return apply_fixed_filter<LAPLACIAN3>(normalise);
+}
+
+template <typename T>
+BasicImage<T>& BasicImage<T>::laplacian5(bool normalise) {
+    return apply_fixed_filter<LAPLACIAN5>(normalise);
+}
+
+template <typename T>
+BasicImage<T>& BasicImage<T>::box(bool normalise) {
+    return apply_fixed_filter<BOX>(normalise);
+}
+
+// Sum over the (2r + 1) x (2r + 1) square around each
+// pixel, divided by its area when normalised, with edges
+// clamped as in the other filters and results saturated to
+// the channel range. Sliding sums along rows, then down
+// columns, make the cost per pixel independent of the
+// radius, with each starting sum counting the clamped edge
+// once for all of its copies. A radius below zero counts as
+// zero.
+template <typename T>
+BasicImage<T>& BasicImage<T>::box_blur(int radius,
+                                       bool normalise) {
+    constexpr int max_radius = max_box_radius<T>();
+    const int r = std::max(0, radius);
+    if (r > max_radius) {
+        throw std::invalid_argument(
+            "box_blur radius over " +
+            std::to_string(max_radius));
+    }
+    if (data.empty()) {
+        return *this;
+    }
+    const double side = 2.0 * r + 1.0;
+    double inv_kmag = normalise ? 1.0 / (side * side) : 0.0;
+    auto times = [](const lvec4& v, long long k) {
+        return lvec4{v.r * k, v.g * k, v.b * k, v.a * k};
+    };
+    // Row sums, which reach 2r + 1 times the largest
+    // channel, so are kept in 64 bits like the column sums
+    auto tmp = std::vector<lvec4>(data.size());
+    auto f_h = [&](int j_begin, int j_end) {
+        const int inside = std::min(r, w - 1);
+        for (int j = j_begin; j < j_end; j++) {
+            const vec4<T>* src = &data[j * w];
+            auto px = [&](int x) {
+                return vec4_cast<long long>(
+                    src[std::clamp(x, 0, w - 1)]);
+            };
+            auto sum = times(px(0), r + 1);
+            sum = sum.add(times(px(w - 1), r - inside));
+            for (int x = 1; x <= inside; x++) {
+                sum = sum.add(px(x));
+            }
+            for (int i = 0; i < w; i++) {
+                tmp[j * w + i] = sum;
+                sum = sum.add(px(i + r + 1)).sub(px(i - r));
+            }
+        }
+    };
+    parallel_for(0, h, f_h, ROW_GRAIN);
+    using limits = std::numeric_limits<T>;
+    constexpr long long lo = limits::min();
+    constexpr long long hi = limits::max();
+    // Each thread slides a row of running sums down a band
+    // of columns
+    auto f_v = [&](int i_begin, int i_end) {
+        const int n = i_end - i_begin;
+        auto row = [&](int y) {
+            int yc = std::clamp(y, 0, h - 1);
+            return &tmp[yc * w + i_begin];
+        };
+        const int inside = std::min(r, h - 1);
+        auto sums = std::vector<lvec4>(n);
+        for (int i = 0; i < n; i++) {
+            sums[i] = times(row(0)[i], r + 1);
+            sums[i] = sums[i].add(
+                times(row(h - 1)[i], r - inside));
+        }
+        for (int y = 1; y <= inside; y++) {
+            span_add(sums.data(), row(y), sums.data(), n);
+        }
+        for (int j = 0; j < h; j++) {
+            vec4<T>* out = &data[j * w + i_begin];
+            for (int i = 0; i < n; i++) {
+                lvec4 v = sums[i];
+                v.a = 255;
+                if (normalise) {
+                    v = v.scale(inv_kmag);
+                }
+                out[i] = vec4<T>::create(
+                    std::clamp(v.r, lo, hi),
+                    std::clamp(v.g, lo, hi),
+                    std::clamp(v.b, lo, hi), v.a);
+            }
+            lvec4* s = sums.data();
+            span_add(s, row(j + r + 1), s, n);
+            span_sub(s, row(j - r), s, n);
+        }
+    };
+    parallel_for(0, w, f_v, COL_GRAIN);
+    invalidate_luminance();
+    return *this;
 }
 
-Image& Image::box(bool normalise) {
-    auto k = std::vector<int>{1, 1, 1, 1, 1, 1, 1, 1, 1};
-    return apply_filter(Kernel(k, 3, 3), normalise);
+template <typename T>
+BasicImage<T>& BasicImage<T>::gaussian(bool normalise) {
+    return apply_fixed_filter<GAUSSIAN>(normalise);
 }
 
-Image& Image::gaussian(bool normalise) {
-    auto k = std::vector<int>{
-        1,  4, 7, 4,  1,  4,  16, 26, 16, 4, 7, 26, 41,
-        26, 7, 4, 16, 26, 16, 4,  1,  4,  7, 4, 1};
-    return apply_filter(Kernel(k, 5, 5), normalise);
-}
+template class BasicImage<int>;
+template class BasicImage<unsigned char>;
@@ -1,5 +1,5 @@
-#include <cassert>
 #include <chrono>
+#include <cstdlib>
 #include <iostream>
 
 #include "dct.h"
@@ -9,55 +9,41 @@
 #include "rle.h"
 #include "sort.cpp"
 
-std::vector<ivec4> to_vectors(
-    const std::vector<unsigned char>& data) {
-    assert(data.size() % 4 == 0);
-    std::vector<ivec4> out(data.size() / 4);
-    for (size_t i = 0; i < out.size(); i++) {
-        out[i] = ivec4{
-            .r = data[4 * i],
-            .g = data[4 * i + 1],
-            .b = data[4 * i + 2],
-            .a = data[4 * i + 3],
-        };
-    }
-    return out;
-}
-
-std::vector<unsigned char> to_data(
-    const std::vector<ivec4>& data) {
-    std::vector<unsigned char> out(data.size() * 4);
-    for (size_t i = 0; i < data.size(); i++) {
-        const auto& v = data[i];
-        out[4 * i] = v.r;
-        out[4 * i + 1] = v.g;
-        out[4 * i + 2] = v.b;
-        out[4 * i + 3] = v.a;
-    }
-    return out;
-}
-
-// PNG file to RGBA pixel data
-Image decode(const char* filename) {
-    std::vector<unsigned char> png, image;
-    unsigned int width, height;
+// PNG file to RGBA pixel data. lodepng decodes into its own
+// buffer, which is copied once into the image's pixels.
+UImage decode(const char* filename) {
+    static_assert(sizeof(uvec4) == 4);
+    std::vector<unsigned char> png;
+    unsigned char* raw = nullptr;
+    unsigned int width = 0, height = 0;
     unsigned int error = lodepng::load_file(png, filename);
     if (!error) {
-        error = lodepng::decode(image, width, height, png);
+        error = lodepng_decode32(&raw, &width, &height,
+                                 png.data(), png.size());
     }
     if (error) {
         std::cerr << "decoder error " << error << ": "
                   << lodepng_error_text(error) << std::endl;
     }
-    auto i = to_vectors(image);
-    return Image(i, width, height);
+    png = std::vector<unsigned char>();
+    if (raw == nullptr) {
+        return UImage(width, height);
+    }
+    // Built from the decoded range, so the pixels are only
+    // written once
+    const auto* px = reinterpret_cast<const uvec4*>(raw);
+    std::vector<uvec4> pixels(px, px + width * height);
+    std::free(raw);
+    return UImage(std::move(pixels), width, height);
 }
 
-// RGBA pixel data to PNG file
-void encode(const char* filename, const Image& image) {
+// RGBA pixel data to PNG file, read straight from the
+// image's pixels
+void encode(const char* filename, const UImage& image) {
     std::vector<unsigned char> png;
-    const std::vector<unsigned char> data =
-        to_data(image.data);
+    const auto* data =
+        reinterpret_cast<const unsigned char*>(
+            image.data.data());
     unsigned char error =
         lodepng::encode(png, data, image.w, image.h);
     if (!error) {
@@ -70,6 +56,10 @@ void encode(const char* filename, const Image& image) {
     }
 }
 
+void encode(const char* filename, const Image& image) {
+    encode(filename, UImage(image.data, image.w, image.h));
+}
+
 void output_help(char* argv[]) {
     std::cout << "Usage: " << argv[0] << " [image.png]"
               << std::endl;
@@ -111,7 +101,7 @@ int main(int argc, char* argv[]) {
     }
     INIT_TIMER();
     START_TIMER("Decoding");
-    Image v = decode(argv[1]);
+    UImage v = decode(argv[1]);
     END_TIMER();
 
     std::cout << "Input dimensions: " << v.w << "x" << v.h
@@ -124,7 +114,7 @@ int main(int argc, char* argv[]) {
     //     return v;
     // };
 
-    Image x = sort(v, 450, 600);
+    UImage x = sort(v, 450, 600);
 
     // Image x = v.half_size().rgb_to_hsv();
     // .apply_function(f)
@@ -0,0 +1,184 @@
+#include "parallel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+static int num_threads =
+    std::max(1, static_cast<int>(
+                    std::thread::hardware_concurrency()));
+
+void set_num_threads(int n) {
+    num_threads = std::max(1, n);
+}
+
+int get_num_threads() { return num_threads; }
+
+namespace {
+
+// One parallel_for call's chunks, shared with the workers,
+// which may still hold it after the call returns
+struct Job {
+    const std::function<void(int)>* chunk;
+    int n_chunks;
+    std::atomic<int> next{1};
+    // Chunks other than the caller's not yet finished
+    std::atomic<int> pending;
+
+    Job(const std::function<void(int)>* chunk, int n_chunks)
+        : chunk{chunk},
+          n_chunks{n_chunks},
+          pending{n_chunks - 1} {}
+
+    // Runs unclaimed chunks until none are left
+    void help() {
+        for (int c = next++; c < n_chunks; c = next++) {
+            (*chunk)(c);
+            if (--pending == 0) {
+                pending.notify_all();
+            }
+        }
+    }
+};
+
+// Workers kept waiting between calls, so a chain of short
+// operations does not start new threads for every step
+class ThreadPool {
+   public:
+    explicit ThreadPool(int n_workers) {
+        for (int i = 0; i < n_workers; i++) {
+            workers.emplace_back([this] { work(); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+    }
+
+    int size() const { return workers.size(); }
+
+    // Runs chunk(c) for each c in [0, n_chunks), with the
+    // calling thread taking chunk 0 and helping with the
+    // rest, and returns once every chunk is done. If the
+    // caller's chunks throw, the exception is rethrown once
+    // the workers finish theirs.
+    void run(int n_chunks,
+             const std::function<void(int)>& chunk) {
+        auto job = std::make_shared<Job>(&chunk, n_chunks);
+        {
+            std::lock_guard lock(mutex);
+            current = job;
+        }
+        wake.notify_all();
+        std::exception_ptr error;
+        try {
+            chunk(0);
+            job->help();
+        } catch (...) {
+            error = std::current_exception();
+        }
+        auto& pending = job->pending;
+        for (int p = pending; p != 0; p = pending) {
+            pending.wait(p);
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+   private:
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::shared_ptr<Job> current;
+    bool stopping = false;
+    // Declared last, so they are joined before the members
+    // they use are destroyed
+    std::vector<std::jthread> workers;
+
+    void work() {
+        std::shared_ptr<Job> seen;
+        while (true) {
+            std::shared_ptr<Job> job;
+            {
+                std::unique_lock lock(mutex);
+                wake.wait(lock, [&] {
+                    return stopping || current != seen;
+                });
+                if (stopping) {
+                    return;
+                }
+                job = seen = current;
+            }
+            job->help();
+        }
+    }
+};
+
+// Rebuilt when the thread count changes. Only one call can
+// use it at a time, and any other, e.g. a parallel_for
+// nested inside a chunk, starts its own threads instead.
+std::unique_ptr<ThreadPool> pool;
+std::atomic_flag pool_busy;
+
+// Holds pool_busy if it was free
+class PoolClaim {
+   public:
+    PoolClaim() : owned{!pool_busy.test_and_set()} {}
+    ~PoolClaim() {
+        if (owned) {
+            pool_busy.clear();
+        }
+    }
+    const bool owned;
+};
+
+}  // namespace
+
+void parallel_for(int begin, int end,
+                  const std::function<void(int, int)>& f,
+                  int grain) {
+    int len = end - begin;
+    if (len <= 0) {
+        return;
+    }
+    int n_chunks = std::clamp(len / std::max(1, grain), 1,
+                              num_threads);
+    if (n_chunks == 1) {
+        f(begin, end);
+        return;
+    }
+    auto chunk_start = [=](int c) {
+        return begin + static_cast<int>(
+                           static_cast<long long>(len) * c /
+                           n_chunks);
+    };
+    PoolClaim claim;
+    if (!claim.owned) {
+        std::vector<std::jthread> workers;
+        workers.reserve(n_chunks - 1);
+        for (int c = 1; c < n_chunks; c++) {
+            workers.emplace_back(std::cref(f),
+                                 chunk_start(c),
+                                 chunk_start(c + 1));
+        }
+        f(chunk_start(0), chunk_start(1));
+        return;
+    }
+    if (!pool || pool->size() != num_threads - 1) {
+        pool.reset();
+        pool =
+            std::make_unique<ThreadPool>(num_threads - 1);
+    }
+    pool->run(n_chunks, [&](int c) {
+        f(chunk_start(c), chunk_start(c + 1));
+    });
+}
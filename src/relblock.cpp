@@ -64,7 +64,7 @@ Image RelBlock::to_image() const {
             }
         }
     }
-    return Image(data, w, h);
+    return Image(std::move(data), w, h);
 }
 
 Image RelBlock::rel_to_image() const {
@@ -73,5 +73,5 @@ Image RelBlock::rel_to_image() const {
         data[i] = rel_blocks[i].abs();
         data[i].a = 255;
     }
-    return Image(data, w, h);
+    return Image(std::move(data), w, h);
 }
@@ -1,42 +1,170 @@
 #include "rle.h"
 
-void Rle::encode(const std::vector<ivec4>& data) {
-    const auto& v = data[0];
-    int runlength = 1;
-    int i = 1;
-    int len = data.size();
+#include <climits>
+#include <cstdint>
+#include <stdexcept>
+
+#include "parallel.h"
+#include "pointwise.h"
+#include "rlefile.h"
+#include "simd.h"
+
+// Minimum rows encoded by each thread
+static constexpr int ROW_GRAIN = 16;
+
+namespace {
+
+struct Runs {
     std::vector<int> lengths;
     std::vector<ivec4> colours;
-    while (i < len) {
-        const auto& v_tmp = data[i];
-        if (v.r != v_tmp.r || v.g != v_tmp.g ||
-            v.b != v_tmp.b || v.a != v_tmp.a) {
-            lengths.push_back(runlength);
-            colours.push_back(v);
-            runlength = 1;
-        } else {
-            runlength++;
+};
+
+}  // namespace
+
+// Each thread encodes a chunk of whole rows into its own
+// runs, indexing each row's runs from the chunk's start.
+// The chunks are then copied into place and their row
+// offsets shifted by where the chunk lands.
+void Rle::encode(const std::vector<ivec4>& data) {
+    const int n_chunks = std::clamp(h / ROW_GRAIN, 1,
+                                    get_num_threads());
+    auto row_start = [&](int c) {
+        return static_cast<int>(static_cast<long long>(h) *
+                                c / n_chunks);
+    };
+    auto chunks = std::vector<Runs>(n_chunks);
+    row_offsets.assign(h + 1, 0);
+    auto f_encode = [&](int c_begin, int c_end) {
+        for (int c = c_begin; c < c_end; c++) {
+            auto& runs = chunks[c];
+            for (int y = row_start(c); y < row_start(c + 1);
+                 y++) {
+                row_offsets[y] = runs.lengths.size();
+                int end = (y + 1) * w;
+                for (int i = y * w; i < end;) {
+                    int n =
+                        span_run_length(&data[i], end - i);
+                    runs.lengths.push_back(n);
+                    runs.colours.push_back(data[i]);
+                    i += n;
+                }
+            }
         }
-        i++;
+    };
+    parallel_for(0, n_chunks, f_encode);
+    auto chunk_offsets = std::vector<int>(n_chunks + 1);
+    for (int c = 0; c < n_chunks; c++) {
+        chunk_offsets[c + 1] =
+            chunk_offsets[c] + chunks[c].lengths.size();
     }
-    lengths.push_back(runlength);
-    colours.push_back(v);
+    lengths.resize(chunk_offsets[n_chunks]);
+    colours.resize(chunk_offsets[n_chunks]);
+    auto f_copy = [&](int c_begin, int c_end) {
+        for (int c = c_begin; c < c_end; c++) {
+            const auto& runs = chunks[c];
+            int offset = chunk_offsets[c];
+            std::copy(runs.lengths.cbegin(),
+                      runs.lengths.cend(),
+                      lengths.begin() + offset);
+            std::copy(runs.colours.cbegin(),
+                      runs.colours.cend(),
+                      colours.begin() + offset);
+            for (int y = row_start(c); y < row_start(c + 1);
+                 y++) {
+                row_offsets[y] += offset;
+            }
+        }
+    };
+    parallel_for(0, n_chunks, f_copy);
+    row_offsets[h] = chunk_offsets[n_chunks];
 }
 
+// Splits runs where they cross a row boundary, drops empty
+// runs and rebuilds row_offsets
+void Rle::index_rows() {
+    std::vector<int> split_lengths;
+    std::vector<ivec4> split_colours;
+    split_lengths.reserve(lengths.size() + h);
+    split_colours.reserve(lengths.size() + h);
+    row_offsets.assign(h + 1, 0);
+    int y = 0, x = 0;
+    int n_runs = lengths.size();
+    for (int i = 0; i < n_runs; i++) {
+        int length = lengths[i];
+        while (length > 0 && y < h) {
+            if (x == 0) {
+                row_offsets[y] = split_lengths.size();
+            }
+            int n = std::min(length, w - x);
+            split_lengths.push_back(n);
+            split_colours.push_back(colours[i]);
+            length -= n;
+            x += n;
+            if (x == w) {
+                x = 0;
+                y++;
+            }
+        }
+    }
+    for (int j = x == 0 ? y : y + 1; j <= h; j++) {
+        row_offsets[j] = split_lengths.size();
+    }
+    lengths = std::move(split_lengths);
+    colours = std::move(split_colours);
+}
+
+Rle::Rle(int w, int h) : w{w}, h{h} {}
+
 Rle::Rle(const Image& image) : w{image.w}, h{image.h} {
     encode(image.data);
 }
 
+void Rle::save(const std::string& path) const {
+    RleWriter writer(path, w, h);
+    int n_runs = lengths.size();
+    for (int i = 0; i < n_runs; i++) {
+        writer.write_run(lengths[i], colours[i]);
+    }
+    writer.finish();
+}
+
+Rle Rle::load(const std::string& path) {
+    RleReader reader(path);
+    // Pixels are indexed with int
+    if (static_cast<int64_t>(reader.w) * reader.h >
+        INT_MAX) {
+        throw std::runtime_error("RLE image too large in " +
+                                 path);
+    }
+    Rle rle(reader.w, reader.h);
+    int length;
+    ivec4 colour;
+    while (reader.read_run(length, colour)) {
+        rle.lengths.push_back(length);
+        rle.colours.push_back(colour);
+    }
+    rle.index_rows();
+    return rle;
+}
+
+// Rows are expanded in parallel straight into the image,
+// each starting from its first run in the row index
 Image Rle::to_image() const {
-    std::vector<ivec4> out;
-    int rl_len = lengths.size();
-    for (int i = 0; i < rl_len; i++) {
-        int runlength = lengths[i];
-        for (int j = 0; j < runlength; j++) {
-            out.push_back(colours[i]);
+    auto out = std::vector<ivec4>(w * h);
+    auto f = [&](int y_begin, int y_end) {
+        for (int y = y_begin; y < y_end; y++) {
+            ivec4* row = &out[y * w];
+            int x = 0;
+            int end = row_offsets[y + 1];
+            for (int i = row_offsets[y]; i < end; i++) {
+                int n = std::min(lengths[i], w - x);
+                span_fill(row + x, n, colours[i]);
+                x += n;
+            }
         }
-    }
-    return Image(out, w, h);
+    };
+    parallel_for(0, h, f, ROW_GRAIN);
+    return Image(std::move(out), w, h);
 }
 
 void Rle::add_noise(double stddev = 1.0) {
@@ -57,6 +185,8 @@ void Rle::add_noise(double stddev = 1.0) {
         total_len += lengths[i];
         if (total_len > target_len) {
             lengths[i] -= total_len - target_len;
+            std::fill(lengths.begin() + i + 1,
+                      lengths.end(), 0);
             break;
         }
     }
@@ -64,39 +194,73 @@ void Rle::add_noise(double stddev = 1.0) {
         lengths[lengths.size() - 1] +=
             target_len - total_len;
     }
+    index_rows();
 }
 
-void Rle::add_noise_rows(double stddev = 1.0) {
-    std::default_random_engine gen;
-    std::normal_distribution<double> dist(0.0, stddev);
-    int n_prev_runs = 0;
-    for (int j = 0; j < h; j++) {
-        int runs_in_row = 0;
-        int row_len = 0;
-        while (row_len < w) {
-            row_len += lengths[n_prev_runs + runs_in_row];
-            runs_in_row++;
-        }
-        row_len = 0;
-        for (int i = 0; i < runs_in_row; i++) {
-            int idx = n_prev_runs + i;
-            int runlength = static_cast<int>(lengths[idx]);
-            int offset = static_cast<int>(dist(gen));
-            if (runlength < -offset) {
-                lengths[idx] = 0;
-            } else {
-                lengths[idx] = runlength + offset;
+void Rle::add_noise_rows(double stddev,
+                         unsigned int seed) {
+    auto f = [&](int y_begin, int y_end) {
+        for (int y = y_begin; y < y_end; y++) {
+            std::seed_seq seq{seed,
+                              static_cast<unsigned int>(y)};
+            std::default_random_engine gen(seq);
+            std::normal_distribution<double> dist(0.0,
+                                                  stddev);
+            int begin = row_offsets[y];
+            int end = row_offsets[y + 1];
+            int row_len = 0;
+            for (int idx = begin; idx < end; idx++) {
+                int runlength = lengths[idx];
+                int offset = static_cast<int>(dist(gen));
+                if (runlength < -offset) {
+                    lengths[idx] = 0;
+                } else {
+                    lengths[idx] = runlength + offset;
+                }
+                row_len += lengths[idx];
+                if (row_len > w) {
+                    row_len -= lengths[idx];
+                    lengths[idx] = 0;
+                }
             }
-            row_len += lengths[idx];
-            if (row_len > w) {
-                row_len -= lengths[idx];
-                lengths[idx] = 0;
+            if (end > begin) {
+                lengths[end - 1] += w - row_len;
             }
         }
-        if (row_len <= w) {
-            lengths[n_prev_runs + runs_in_row - 1] +=
-                w - row_len;
-        }
-        n_prev_runs += runs_in_row;
-    }
+    };
+    parallel_for(0, h, f, ROW_GRAIN);
+}
+
+Rle& Rle::posterise(bool ignore_alpha) {
+    return map(PosteriseOp{ignore_alpha});
+}
+
+Rle& Rle::abs() { return map(AbsOp{}); }
+
+Rle& Rle::clamp_zero() { return map(ClampZeroOp{}); }
+
+Rle& Rle::hard_clamp(double max) {
+    return map(HardClampOp{max});
+}
+
+Rle& Rle::smooth_clamp(double half, double max) {
+    return map(SmoothClampOp{half, max});
 }
+
+Rle& Rle::modulo(int mod) { return map(ModuloOp{mod}); }
+
+Rle& Rle::scale(double c) { return map(ScaleOp{c}); }
+
+Rle& Rle::remove_red() { return map(RemoveRedOp{}); }
+
+Rle& Rle::remove_green() { return map(RemoveGreenOp{}); }
+
+Rle& Rle::remove_blue() { return map(RemoveBlueOp{}); }
+
+Rle& Rle::black_and_white() {
+    return map(BlackAndWhiteOp{});
+}
+
+Rle& Rle::rgb_to_hsv() { return map(RgbToHsvOp{}); }
+
+Rle& Rle::hsv_to_rgb() { return map(HsvToRgbOp{}); }
@@ -0,0 +1,193 @@
+#include "rlefile.h"
+
+#include <climits>
+#include <stdexcept>
+
+static constexpr char MAGIC[4] = {'D', 'R', 'L', 'E'};
+static constexpr uint8_t VERSION = 1;
+
+RleWriter::RleWriter(const std::string& path, int w, int h)
+    : out{path, std::ios::binary}, w{w}, h{h} {
+    if (!out) {
+        throw std::runtime_error("cannot open " + path);
+    }
+    row_offsets.reserve(h);
+    for (char c : MAGIC) {
+        put_byte(c);
+    }
+    put_byte(VERSION);
+    put_varint(w);
+    put_varint(h);
+}
+
+void RleWriter::put_byte(uint8_t b) {
+    out.put(static_cast<char>(b));
+    pos++;
+}
+
+void RleWriter::put_varint(uint64_t v) {
+    while (v >= 0x80) {
+        put_byte(static_cast<uint8_t>(v | 0x80));
+        v >>= 7;
+    }
+    put_byte(static_cast<uint8_t>(v));
+}
+
+void RleWriter::put_u64(uint64_t v) {
+    for (int i = 0; i < 8; i++) {
+        put_byte(static_cast<uint8_t>(v >> (8 * i)));
+    }
+}
+
+void RleWriter::write_run(int length, const ivec4& colour) {
+    auto c = vec4_cast<unsigned char>(colour);
+    while (length > 0) {
+        // A zero-width image has no room for any run
+        if (row == h || w == 0) {
+            throw std::runtime_error(
+                "RLE runs longer than the image");
+        }
+        if (col == 0) {
+            row_offsets.push_back(pos);
+        }
+        int n = std::min(length, w - col);
+        put_varint(n);
+        put_byte(c.r);
+        put_byte(c.g);
+        put_byte(c.b);
+        put_byte(c.a);
+        length -= n;
+        col += n;
+        if (col == w) {
+            col = 0;
+            row++;
+        }
+    }
+}
+
+void RleWriter::finish() {
+    if (row != h && w > 0) {
+        throw std::runtime_error(
+            "RLE runs shorter than the image");
+    }
+    row_offsets.resize(h, pos);
+    uint64_t footer = pos;
+    for (uint64_t offset : row_offsets) {
+        put_u64(offset);
+    }
+    put_u64(footer);
+    out.flush();
+    if (!out) {
+        throw std::runtime_error("RLE write failed");
+    }
+}
+
+RleReader::RleReader(const std::string& path)
+    : in{path, std::ios::binary} {
+    if (!in) {
+        throw std::runtime_error("cannot open " + path);
+    }
+    for (char c : MAGIC) {
+        if (static_cast<char>(get_byte()) != c) {
+            throw std::runtime_error(path +
+                                     " is not an RLE file");
+        }
+    }
+    if (get_byte() != VERSION) {
+        throw std::runtime_error(
+            "unsupported RLE version in " + path);
+    }
+    uint64_t w64 = get_varint();
+    uint64_t h64 = get_varint();
+    if (w64 > INT_MAX || h64 > INT_MAX) {
+        throw std::runtime_error(
+            "RLE image size out of range in " + path);
+    }
+    w = static_cast<int>(w64);
+    h = static_cast<int>(h64);
+    // The footer must be the h row offsets and its own
+    // offset exactly, checked before allocating the index
+    uint64_t body = static_cast<uint64_t>(in.tellg());
+    in.seekg(0, std::ios::end);
+    uint64_t size = static_cast<uint64_t>(in.tellg());
+    uint64_t footer_size = 8 * (h64 + 1);
+    if (size < body + footer_size) {
+        throw std::runtime_error("truncated RLE file");
+    }
+    in.seekg(-8, std::ios::end);
+    uint64_t footer = get_u64();
+    if (footer < body || size - footer != footer_size) {
+        throw std::runtime_error(
+            "corrupt RLE row index in " + path);
+    }
+    in.seekg(static_cast<std::streamoff>(footer));
+    row_offsets.resize(h);
+    for (auto& offset : row_offsets) {
+        offset = get_u64();
+        if (offset < body || offset > footer) {
+            throw std::runtime_error(
+                "corrupt RLE row index in " + path);
+        }
+    }
+    in.seekg(static_cast<std::streamoff>(body));
+    remaining = static_cast<int64_t>(w) * h;
+}
+
+uint8_t RleReader::get_byte() {
+    int b = in.get();
+    if (b == std::char_traits<char>::eof()) {
+        throw std::runtime_error("truncated RLE file");
+    }
+    return static_cast<uint8_t>(b);
+}
+
+uint64_t RleReader::get_varint() {
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        uint8_t b = get_byte();
+        v |= static_cast<uint64_t>(b & 0x7F) << shift;
+        if ((b & 0x80) == 0) {
+            return v;
+        }
+    }
+    throw std::runtime_error("corrupt RLE varint");
+}
+
+uint64_t RleReader::get_u64() {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++) {
+        v |= static_cast<uint64_t>(get_byte()) << (8 * i);
+    }
+    return v;
+}
+
+bool RleReader::read_run(int& length, ivec4& colour) {
+    if (remaining == 0) {
+        return false;
+    }
+    uint64_t n = get_varint();
+    if (n == 0 || n > static_cast<uint64_t>(remaining)) {
+        throw std::runtime_error("corrupt RLE run length");
+    }
+    uvec4 c;
+    c.r = get_byte();
+    c.g = get_byte();
+    c.b = get_byte();
+    c.a = get_byte();
+    length = static_cast<int>(n);
+    colour = vec4_cast<int>(c);
+    remaining -= length;
+    return true;
+}
+
+void RleReader::seek_row(int y) {
+    if (y < 0 || y >= h) {
+        throw std::runtime_error(
+            "RLE row " + std::to_string(y) +
+            " out of range");
+    }
+    in.clear();
+    auto offset = row_offsets[y];
+    in.seekg(static_cast<std::streamoff>(offset));
+    remaining = static_cast<int64_t>(w) * (h - y);
+}
@@ -0,0 +1,520 @@
+#include "simd.h"
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+static_assert(sizeof(ivec4) == 4 * sizeof(int));
+static_assert(sizeof(lvec4) == 4 * sizeof(long long));
+
+// Each kernel has an SSE2 version, which every x86-64 build
+// has, ending in the scalar vec4 code for the rest of the
+// span or for other targets. Kernels with a wider path also
+// have an AVX2 version. A native AVX2 build calls it
+// directly, and otherwise it is built for AVX2 on its own
+// and only called when the CPU supports it.
+#if defined(__AVX2__)
+#define SIMD_AVX2
+#define AVX2_TARGET
+static bool cpu_has_avx2() { return true; }
+#elif defined(__SSE2__) && defined(__GNUC__)
+#define SIMD_AVX2
+#define AVX2_TARGET __attribute__((target("avx2")))
+static bool cpu_has_avx2() {
+    static const bool has = [] {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") != 0;
+    }();
+    return has;
+}
+#endif
+
+// Calls name_avx2 where the CPU has AVX2, or else
+// name_sse2, with the same arguments
+#if defined(SIMD_AVX2)
+#define DISPATCH(name, ...)                   \
+    (cpu_has_avx2() ? name##_avx2(__VA_ARGS__) \
+                    : name##_sse2(__VA_ARGS__))
+#else
+#define DISPATCH(name, ...) name##_sse2(__VA_ARGS__)
+#endif
+
+#if defined(__SSE2__)
+static inline __m128i load(const ivec4* p) {
+    return _mm_loadu_si128(
+        reinterpret_cast<const __m128i*>(p));
+}
+
+static inline void store(ivec4* p, __m128i v) {
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(p), v);
+}
+
+// Channels r and g when k is 0, or b and a when k is 1
+static inline __m128i load_half(const lvec4* p, int k) {
+    return _mm_loadu_si128(
+        reinterpret_cast<const __m128i*>(p) + k);
+}
+
+static inline void store_half(lvec4* p, int k, __m128i v) {
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(p) + k, v);
+}
+
+// Lanes below zero set to zero
+static inline __m128i max_zero(__m128i v) {
+    return _mm_andnot_si128(_mm_srai_epi32(v, 31), v);
+}
+
+// Lanes above hi set to hi
+static inline __m128i min_hi(__m128i v, __m128i hi) {
+    __m128i over = _mm_cmpgt_epi32(v, hi);
+    return _mm_or_si128(_mm_and_si128(over, hi),
+                        _mm_andnot_si128(over, v));
+}
+#endif
+
+#if defined(SIMD_AVX2)
+AVX2_TARGET static inline __m256i load2(const ivec4* p) {
+    return _mm256_loadu_si256(
+        reinterpret_cast<const __m256i*>(p));
+}
+
+AVX2_TARGET static inline void store2(ivec4* p,
+                                      __m256i v) {
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), v);
+}
+
+AVX2_TARGET static inline __m256i load_wide(
+    const lvec4* p) {
+    return _mm256_loadu_si256(
+        reinterpret_cast<const __m256i*>(p));
+}
+
+AVX2_TARGET static inline void store_wide(lvec4* p,
+                                          __m256i v) {
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), v);
+}
+#endif
+
+static void span_add_sse2(const ivec4* src, const ivec4* x,
+                          ivec4* dst, int n) {
+    int i = 0;
+#if defined(__SSE2__)
+    for (; i < n; i++) {
+        store(dst + i,
+              _mm_add_epi32(load(src + i), load(x + i)));
+    }
+#endif
+    for (; i < n; i++) {
+        dst[i] = src[i].add(x[i]);
+    }
+}
+
+#if defined(SIMD_AVX2)
+AVX2_TARGET static void span_add_avx2(const ivec4* src,
+                                      const ivec4* x,
+                                      ivec4* dst, int n) {
+    int i = 0;
+    for (; i + 2 <= n; i += 2) {
+        store2(dst + i, _mm256_add_epi32(load2(src + i),
+                                         load2(x + i)));
+    }
+    span_add_sse2(src + i, x + i, dst + i, n - i);
+}
+#endif
+
+void span_add(const ivec4* src, const ivec4* x, ivec4* dst,
+              int n) {
+    DISPATCH(span_add, src, x, dst, n);
+}
+
+static void span_sub_sse2(const ivec4* src, const ivec4* x,
+                          ivec4* dst, int n) {
+    int i = 0;
+#if defined(__SSE2__)
+    for (; i < n; i++) {
+        store(dst + i,
+              _mm_sub_epi32(load(src + i), load(x + i)));
+    }
+#endif
+    for (; i < n; i++) {
+        dst[i] = src[i].sub(x[i]);
+    }
+}
+
+#if defined(SIMD_AVX2)
+AVX2_TARGET static void span_sub_avx2(const ivec4* src,
+                                      const ivec4* x,
+                                      ivec4* dst, int n) {
+    int i = 0;
+    for (; i + 2 <= n; i += 2) {
+        store2(dst + i, _mm256_sub_epi32(load2(src + i),
+                                         load2(x + i)));
+    }
+    span_sub_sse2(src + i, x + i, dst + i, n - i);
+}
+#endif
+
+void span_sub(const ivec4* src, const ivec4* x, ivec4* dst,
+              int n) {
+    DISPATCH(span_sub, src, x, dst, n);
+}
+
+// 64-bit lanes, so one pixel per AVX2 instruction or two
+// SSE2 instructions per pixel
+static void span_add_wide_sse2(const lvec4* src,
+                               const lvec4* x, lvec4* dst,
+                               int n) {
+    int i = 0;
+#if defined(__SSE2__)
+    for (; i < n; i++) {
+        for (int k = 0; k < 2; k++) {
+            __m128i v = load_half(x + i, k);
+            __m128i sum = load_half(src + i, k);
+            store_half(dst + i, k, _mm_add_epi64(sum, v));
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        dst[i] = src[i].add(x[i]);
+    }
+}
+
+#if defined(SIMD_AVX2)
+AVX2_TARGET static void span_add_wide_avx2(const lvec4* src,
+                                           const lvec4* x,
+                                           lvec4* dst,
+                                           int n) {
+    for (int i = 0; i < n; i++) {
+        store_wide(dst + i,
+                   _mm256_add_epi64(load_wide(src + i),
+                                    load_wide(x + i)));
+    }
+}
+#endif
+
+void span_add(const lvec4* src, const lvec4* x, lvec4* dst,
+              int n) {
+    DISPATCH(span_add_wide, src, x, dst, n);
+}
+
+static void span_sub_wide_sse2(const lvec4* src,
+                               const lvec4* x, lvec4* dst,
+                               int n) {
+    int i = 0;
+#if defined(__SSE2__)
+    for (; i < n; i++) {
+        for (int k = 0; k < 2; k++) {
+            __m128i v = load_half(x + i, k);
+            __m128i sum = load_half(src + i, k);
+            store_half(dst + i, k, _mm_sub_epi64(sum, v));
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        dst[i] = src[i].sub(x[i]);
+    }
+}
+
+#if defined(SIMD_AVX2)
+AVX2_TARGET static void span_sub_wide_avx2(const lvec4* src,
+                                           const lvec4* x,
+                                           lvec4* dst,
+                                           int n) {
+    for (int i = 0; i < n; i++) {
+        store_wide(dst + i,
+                   _mm256_sub_epi64(load_wide(src + i),
+                                    load_wide(x + i)));
+    }
+}
+#endif
+
+void span_sub(const lvec4* src, const lvec4* x, lvec4* dst,
+              int n) {
+    DISPATCH(span_sub_wide, src, x, dst, n);
+}
+
+// Colour channels are scaled in double precision and
+// truncated, and alpha is set to 255
+static void span_scale_sse2(const ivec4* src, ivec4* dst,
+                            int n, double c) {
+    int i = 0;
+#if defined(__SSE2__)
+    const __m128d vc = _mm_set1_pd(c);
+    const __m128i rgb = _mm_set_epi32(0, -1, -1, -1);
+    const __m128i alpha = _mm_set_epi32(255, 0, 0, 0);
+    for (; i < n; i++) {
+        __m128i p = load(src + i);
+        __m128d rg = _mm_mul_pd(vc, _mm_cvtepi32_pd(p));
+        __m128d ba = _mm_mul_pd(
+            vc, _mm_cvtepi32_pd(_mm_srli_si128(p, 8)));
+        __m128i v = _mm_unpacklo_epi64(
+            _mm_cvttpd_epi32(rg), _mm_cvttpd_epi32(ba));
+        store(dst + i,
+              _mm_or_si128(_mm_and_si128(v, rgb), alpha));
+    }
+#endif
+    for (; i < n; i++) {
+        dst[i] = src[i].scale(c);
+    }
+}
+
+#if defined(SIMD_AVX2)
+AVX2_TARGET static void span_scale_avx2(const ivec4* src,
+                                        ivec4* dst, int n,
+                                        double c) {
+    const __m256d vc = _mm256_set1_pd(c);
+    const __m128i alpha = _mm_set_epi32(255, 0, 0, 0);
+    for (int i = 0; i < n; i++) {
+        __m256d d = _mm256_cvtepi32_pd(load(src + i));
+        __m128i v =
+            _mm256_cvttpd_epi32(_mm256_mul_pd(vc, d));
+        store(dst + i, _mm_blend_epi16(v, alpha, 0xC0));
+    }
+}
+#endif
+
+void span_scale(const ivec4* src, ivec4* dst, int n,
+                double c) {
+    DISPATCH(span_scale, src, dst, n, c);
+}
+
+// abs(v) as (v ^ s) - s, where s is all ones for negative
+// lanes
+static void span_abs_sse2(const ivec4* src, ivec4* dst,
+                          int n) {
+    int i = 0;
+#if defined(__SSE2__)
+    for (; i < n; i++) {
+        __m128i v = load(src + i);
+        __m128i s = _mm_srai_epi32(v, 31);
+        store(dst + i,
+              _mm_sub_epi32(_mm_xor_si128(v, s), s));
+    }
+#endif
+    for (; i < n; i++) {
+        dst[i] = src[i].abs();
+    }
+}
+
+#if defined(SIMD_AVX2)
+AVX2_TARGET static void span_abs_avx2(const ivec4* src,
+                                      ivec4* dst, int n) {
+    int i = 0;
+    for (; i + 2 <= n; i += 2) {
+        store2(dst + i, _mm256_abs_epi32(load2(src + i)));
+    }
+    span_abs_sse2(src + i, dst + i, n - i);
+}
+#endif
+
+void span_abs(const ivec4* src, ivec4* dst, int n) {
+    DISPATCH(span_abs, src, dst, n);
+}
+
+static void span_min_zero_sse2(const ivec4* src,
+                               ivec4* dst, int n) {
+    int i = 0;
+#if defined(__SSE2__)
+    for (; i < n; i++) {
+        store(dst + i, max_zero(load(src + i)));
+    }
+#endif
+    for (; i < n; i++) {
+        dst[i] = src[i].min_zero();
+    }
+}
+
+#if defined(SIMD_AVX2)
+AVX2_TARGET static void span_min_zero_avx2(const ivec4* src,
+                                           ivec4* dst,
+                                           int n) {
+    int i = 0;
+    const __m256i zero2 = _mm256_setzero_si256();
+    for (; i + 2 <= n; i += 2) {
+        store2(dst + i,
+               _mm256_max_epi32(load2(src + i), zero2));
+    }
+    span_min_zero_sse2(src + i, dst + i, n - i);
+}
+#endif
+
+void span_min_zero(const ivec4* src, ivec4* dst, int n) {
+    DISPATCH(span_min_zero, src, dst, n);
+}
+
+static void span_hard_clamp_sse2(const ivec4* src,
+                                 ivec4* dst, int n,
+                                 double max) {
+    int i = 0;
+#if defined(__SSE2__)
+    const __m128i hi =
+        _mm_set1_epi32(static_cast<int>(max));
+    for (; i < n; i++) {
+        __m128i v = min_hi(load(src + i), hi);
+        store(dst + i, max_zero(v));
+    }
+#endif
+    for (; i < n; i++) {
+        dst[i] = src[i].hard_clamp(max);
+    }
+}
+
+#if defined(SIMD_AVX2)
+AVX2_TARGET static void span_hard_clamp_avx2(
+    const ivec4* src, ivec4* dst, int n, double max) {
+    int i = 0;
+    const __m256i zero2 = _mm256_setzero_si256();
+    const __m256i hi2 =
+        _mm256_set1_epi32(static_cast<int>(max));
+    for (; i + 2 <= n; i += 2) {
+        __m256i v = _mm256_min_epi32(load2(src + i), hi2);
+        store2(dst + i, _mm256_max_epi32(v, zero2));
+    }
+    span_hard_clamp_sse2(src + i, dst + i, n - i, max);
+}
+#endif
+
+void span_hard_clamp(const ivec4* src, ivec4* dst, int n,
+                     double max) {
+    DISPATCH(span_hard_clamp, src, dst, n, max);
+}
+
+// Products are summed in the same order as
+// vec4::luminance, then scaled by 256 exactly before
+// truncating, so every version matches it as long as the
+// compiler does not fuse the scalar version into
+// multiply-adds, which the native build turns off
+static void span_luminance_8_8_sse2(const ivec4* src,
+                                    int* dst, int n) {
+    int i = 0;
+#if defined(__SSE2__)
+    const __m128d c_rg = _mm_set_pd(0.7152, 0.2126);
+    const __m128d c_b = _mm_set_sd(0.0722);
+    const __m128d scale = _mm_set_sd(256.0);
+    for (; i < n; i++) {
+        __m128i p = load(src + i);
+        __m128d rg = _mm_mul_pd(c_rg, _mm_cvtepi32_pd(p));
+        __m128d b = _mm_mul_sd(
+            c_b, _mm_cvtepi32_pd(_mm_srli_si128(p, 8)));
+        __m128d lum = _mm_add_sd(
+            _mm_add_sd(rg, _mm_unpackhi_pd(rg, rg)), b);
+        dst[i] = _mm_cvttsd_si32(_mm_mul_sd(lum, scale));
+    }
+#endif
+    for (; i < n; i++) {
+        dst[i] =
+            static_cast<int>(src[i].luminance() * 256.0);
+    }
+}
+
+#if defined(SIMD_AVX2)
+AVX2_TARGET static void span_luminance_8_8_avx2(
+    const ivec4* src, int* dst, int n) {
+    int i = 0;
+    const __m256d coeffs =
+        _mm256_set_pd(0.0, 0.0722, 0.7152, 0.2126);
+    const __m128d scale = _mm_set1_pd(256.0);
+    for (; i + 2 <= n; i += 2) {
+        __m256d p0 = _mm256_mul_pd(
+            coeffs, _mm256_cvtepi32_pd(load(src + i)));
+        __m256d p1 = _mm256_mul_pd(
+            coeffs, _mm256_cvtepi32_pd(load(src + i + 1)));
+        // r + g of both pixels in the low half, b + 0 in
+        // the high half
+        __m256d s = _mm256_hadd_pd(p0, p1);
+        __m128d lum =
+            _mm_add_pd(_mm256_castpd256_pd128(s),
+                       _mm256_extractf128_pd(s, 1));
+        __m128i v =
+            _mm_cvttpd_epi32(_mm_mul_pd(lum, scale));
+        _mm_storel_epi64(
+            reinterpret_cast<__m128i*>(dst + i), v);
+    }
+    span_luminance_8_8_sse2(src + i, dst + i, n - i);
+}
+#endif
+
+void span_luminance_8_8(const ivec4* src, int* dst, int n) {
+    DISPATCH(span_luminance_8_8, src, dst, n);
+}
+
+static bool same_px(const ivec4& a, const ivec4& b) {
+    return a.r == b.r && a.g == b.g && a.b == b.b &&
+           a.a == b.a;
+}
+
+// Compares all four channels at once, from pixel `from`
+// on, where the pixels before it already match
+static int span_run_length_sse2(const ivec4* src, int n,
+                                int from) {
+    int i = from;
+#if defined(__SSE2__)
+    const __m128i first = load(src);
+    for (; i < n; i++) {
+        __m128i eq = _mm_cmpeq_epi32(load(src + i), first);
+        if (_mm_movemask_epi8(eq) != 0xFFFF) {
+            return i;
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        if (!same_px(src[i], src[0])) {
+            return i;
+        }
+    }
+    return n;
+}
+
+#if defined(SIMD_AVX2)
+AVX2_TARGET static int span_run_length_avx2(
+    const ivec4* src, int n, int from) {
+    int i = from;
+    const __m256i first2 =
+        _mm256_broadcastsi128_si256(load(src));
+    for (; i + 2 <= n; i += 2) {
+        __m256i eq =
+            _mm256_cmpeq_epi32(load2(src + i), first2);
+        unsigned int mask = _mm256_movemask_epi8(eq);
+        if (mask != 0xFFFFFFFF) {
+            return (mask & 0xFFFF) == 0xFFFF ? i + 1 : i;
+        }
+    }
+    return span_run_length_sse2(src, n, i);
+}
+#endif
+
+int span_run_length(const ivec4* src, int n) {
+    return DISPATCH(span_run_length, src, n, 1);
+}
+
+static void span_fill_sse2(ivec4* dst, int n,
+                           const ivec4& v) {
+    int i = 0;
+#if defined(__SSE2__)
+    const __m128i v1 = load(&v);
+    for (; i < n; i++) {
+        store(dst + i, v1);
+    }
+#endif
+    for (; i < n; i++) {
+        dst[i] = v;
+    }
+}
+
+#if defined(SIMD_AVX2)
+// Stores two pixels at a time
+AVX2_TARGET static void span_fill_avx2(ivec4* dst, int n,
+                                       const ivec4& v) {
+    int i = 0;
+    const __m256i v2 =
+        _mm256_broadcastsi128_si256(load(&v));
+    for (; i + 2 <= n; i += 2) {
+        store2(dst + i, v2);
+    }
+    span_fill_sse2(dst + i, n - i, v);
+}
+#endif
+
+void span_fill(ivec4* dst, int n, const ivec4& v) {
+    DISPATCH(span_fill, dst, n, v);
+}
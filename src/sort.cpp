@@ -1,75 +1,102 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <numeric>
 #include <queue>
-#include <set>
+#include <utility>
+#include <vector>
 
 #include "image.h"
+#include "parallel.h"
 
-struct Pixel {
+// Max-priority queue of pixel indices keyed on 8.8
+// fixed-point luminance, as cached by the image. Every key
+// has its own bucket, and a two-level bitmap of the
+// non-empty buckets finds the largest key with a few word
+// scans, so push and pop take constant time. Pixels within
+// the same 1/256 step of luminance pop last in, first out.
+class LumQueue {
    public:
-    int x, y;
-    double lum;
+    static constexpr int KEYS = 1 << 16;
 
-    Pixel(int x, int y, double lum)
-        : x(x), y(y), lum(lum) {}
-};
-
-auto compare_lum = [](const Pixel& p1, const Pixel& p2) {
-    return p1.lum < p2.lum;
-};
-
-auto compare_loc = [](const Pixel& p1, const Pixel& p2) {
-    if (p1.x < p2.x) {
-        return true;
-    } else if (p1.x > p2.x) {
-        return false;
+    // Luminance outside [0, 256) is clamped to the end keys
+    static int key(int lum) {
+        return std::clamp(lum, 0, KEYS - 1);
     }
-    return p1.y < p2.y;
-};
 
-Pixel create_px(const Image& image, int x, int y) {
-    double lum = image.get_px(x, y).luminance();
-    return Pixel(x, y, lum);
-}
+    bool empty() const { return size == 0; }
 
-typedef std::set<Pixel, decltype(compare_loc)> PixelSet;
-typedef std::priority_queue<Pixel, std::vector<Pixel>,
-                            decltype(compare_lum)>
-    PixelQueue;
+    void push(int px, int key) {
+        buckets[key].push_back(px);
+        words[key >> 6] |= bit(key);
+        summary[key >> 12] |= bit(key >> 6);
+        size++;
+    }
 
-std::vector<Pixel> new_neighbours(const Image& image,
-                                  PixelSet& visited, int x,
-                                  int y) {
-    std::vector<Pixel> v;
-    if (x > 0) {
-        Pixel px = create_px(image, x - 1, y);
-        if (!visited.contains(px)) {
-            v.push_back(px);
+    int pop() {
+        int s = static_cast<int>(summary.size()) - 1;
+        while (summary[s] == 0) {
+            s--;
         }
-    }
-    if (x + 1 < image.w) {
-        Pixel px = create_px(image, x + 1, y);
-        if (!visited.contains(px)) {
-            v.push_back(px);
+        int w = (s << 6) + std::bit_width(summary[s]) - 1;
+        int key = (w << 6) + std::bit_width(words[w]) - 1;
+        auto& bucket = buckets[key];
+        int px = bucket.back();
+        bucket.pop_back();
+        if (bucket.empty()) {
+            words[w] &= ~bit(key);
+            if (words[w] == 0) {
+                summary[s] &= ~bit(w);
+            }
         }
+        size--;
+        return px;
     }
-    if (y > 0) {
-        Pixel px = create_px(image, x, y - 1);
-        if (!visited.contains(px)) {
-            v.push_back(px);
-        }
+
+   private:
+    std::vector<std::vector<int>> buckets =
+        std::vector<std::vector<int>>(KEYS);
+    std::array<uint64_t, KEYS / 64> words{};
+    std::array<uint64_t, KEYS / 64 / 64> summary{};
+    int size = 0;
+
+    static uint64_t bit(int i) {
+        return uint64_t{1} << (i & 63);
     }
-    if (y + 1 < image.h) {
-        Pixel px = create_px(image, x, y + 1);
-        if (!visited.contains(px)) {
-            v.push_back(px);
-        }
+};
+
+// Queue with the same order as LumQueue, kept as a binary
+// heap that only grows as far as it is filled, for when
+// many small queues are live at once. Entries order on key
+// and then on push order, latest first.
+class LumHeap {
+   public:
+    bool empty() const { return heap.empty(); }
+
+    void push(int px, int key) {
+        uint64_t order =
+            (static_cast<uint64_t>(key) << 32) | seq++;
+        heap.emplace(order, px);
     }
-    return v;
-}
 
-ivec4 colour(const Image& image, int i) {
+    int pop() {
+        int px = heap.top().second;
+        heap.pop();
+        return px;
+    }
+
+   private:
+    std::priority_queue<std::pair<uint64_t, int>> heap;
+    uint32_t seq = 0;
+};
+
+// Colour of the i-th of max pixels, along a ramp through
+// the 24-bit colours
+ivec4 colour(int i, int max) {
     constexpr double colour_max =
         static_cast<double>(0xFFFFFF);
-    int max = image.w * image.h;
     int colour = static_cast<int>(
         (static_cast<double>(i)) *
         (colour_max / static_cast<double>(max)));
@@ -77,37 +104,129 @@ ivec4 colour(const Image& image, int i) {
                  (colour & 0x00FF00) >> 8,
                  colour & 0x0000FF, 255);
     // constexpr double colour_max =
-    // static_cast<double>(0xFF); int max = image.w *
-    // image.h; int colour = static_cast<int>(
+    // static_cast<double>(0xFF); int colour =
+    // static_cast<int>(
     //     (static_cast<double>(colour_max - i)) *
     //     (colour_max / static_cast<double>(max)));
     // return ivec4(colour, colour, colour, 255);
 }
 
-Image sort(const Image& image, int x, int y) {
-    PixelQueue frontier;
-    PixelSet visited;
-    Image new_image(image.w, image.h);
-    Pixel curr = create_px(image, x, y);
-    visited.insert(curr);
-    for (const Pixel& px :
-         new_neighbours(image, visited, curr.x, curr.y)) {
-        frontier.push(px);
-        visited.insert(px);
+// Calls f with the index of each pixel 4-adjacent to px
+template <typename T, typename F>
+void for_each_neighbour(const BasicImage<T>& image, int px,
+                        F f) {
+    int x = px % image.w;
+    int y = px / image.w;
+    if (x > 0) {
+        f(px - 1);
+    }
+    if (x + 1 < image.w) {
+        f(px + 1);
+    }
+    if (y > 0) {
+        f(px - image.w);
+    }
+    if (y + 1 < image.h) {
+        f(px + image.w);
     }
+}
+
+// Floods outward from (x, y), always visiting the brightest
+// pixel on the frontier next, and colours pixels by the
+// order they were visited in. The visited set is a bitmap
+// over pixel indices.
+template <typename T>
+BasicImage<T> sort(const BasicImage<T>& image, int x,
+                   int y) {
+    const auto& lum = image.luminance();
+    LumQueue frontier;
+    std::vector<bool> visited(image.data.size());
+    BasicImage<T> new_image(image.w, image.h);
+    auto visit = [&](int px) {
+        if (!visited[px]) {
+            visited[px] = true;
+            frontier.push(px, LumQueue::key(lum[px]));
+        }
+    };
+    int start = y * image.w + x;
+    visited[start] = true;
+    for_each_neighbour(image, start, visit);
     int i = 0;
     while (!frontier.empty()) {
-        curr = frontier.top();
-        frontier.pop();
-        ivec4 v = colour(image, i);
+        int px = frontier.pop();
+        ivec4 v = colour(i, image.w * image.h);
         i++;
-        new_image.set_px(curr.x, curr.y, v);
-        visited.insert(curr);
-        for (const Pixel& px : new_neighbours(
-                 image, visited, curr.x, curr.y)) {
-            frontier.push(px);
-            visited.insert(px);
-        }
+        new_image.data[px] = vec4_cast<T>(v);
+        for_each_neighbour(image, px, visit);
     }
     return new_image;
 }
+
+// Grows a region from each seed at once, each flooding
+// outward like sort() from its own frontier. A pixel
+// belongs to the first region to reach it, claimed through
+// an atomic ownership map, and each region is coloured with
+// its own full ramp. Seeds are split across threads, and a
+// thread takes turns growing its regions by one pixel.
+// Where regions meet depends on how the threads interleave,
+// so unlike the other parallel operations the result can
+// change between runs and with the number of threads.
+template <typename T>
+BasicImage<T> sort(
+    const BasicImage<T>& image,
+    const std::vector<std::pair<int, int>>& seeds) {
+    // Built up front, as threads only read it
+    const auto& lum = image.luminance();
+    // Owning region + 1, or 0 while unclaimed
+    std::vector<std::atomic<int>> owner(image.data.size());
+    BasicImage<T> new_image(image.w, image.h);
+    struct Region {
+        LumHeap frontier;
+        std::vector<int> visited;
+    };
+    auto grow = [&](int begin, int end) {
+        std::vector<Region> regions(end - begin);
+        auto claim = [&](int r, int px) {
+            int unowned = 0;
+            if (owner[px].compare_exchange_strong(
+                    unowned, r + 1,
+                    std::memory_order_relaxed)) {
+                regions[r - begin].frontier.push(
+                    px, LumQueue::key(lum[px]));
+            }
+        };
+        for (int r = begin; r < end; r++) {
+            auto [x, y] = seeds[r];
+            claim(r, y * image.w + x);
+        }
+        // Regions still growing, in turn order
+        std::vector<int> active(end - begin);
+        std::iota(active.begin(), active.end(), begin);
+        while (!active.empty()) {
+            int n_active = 0;
+            for (int r : active) {
+                Region& region = regions[r - begin];
+                if (region.frontier.empty()) {
+                    continue;
+                }
+                active[n_active++] = r;
+                int px = region.frontier.pop();
+                region.visited.push_back(px);
+                for_each_neighbour(image, px, [&](int n) {
+                    claim(r, n);
+                });
+            }
+            active.resize(n_active);
+        }
+        for (const Region& region : regions) {
+            int n = static_cast<int>(region.visited.size());
+            for (int i = 0; i < n; i++) {
+                ivec4 v = colour(i, n);
+                new_image.data[region.visited[i]] =
+                    vec4_cast<T>(v);
+            }
+        }
+    };
+    parallel_for(0, static_cast<int>(seeds.size()), grow);
+    return new_image;
+}
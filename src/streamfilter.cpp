@@ -0,0 +1,62 @@
+#include "streamfilter.h"
+
+StreamFilter::StreamFilter(const Kernel& kernel, int w,
+                           bool normalise, Sink sink)
+    : kernel{kernel},
+      w{w},
+      r{kernel.h / 2},
+      inv_kmag{normalise ? 1.0 / kernel.abs_mag() : 0.0},
+      sink{std::move(sink)},
+      ring(static_cast<size_t>((2 * r + 1) * w)),
+      rows(2 * r + 1),
+      out(w) {}
+
+ivec4* StreamFilter::slot(int y) {
+    return &ring[(y + r) % (2 * r + 1) * w];
+}
+
+// Rows above the first are copies of it, and each row
+// pushed completes the row r above it
+template <typename T>
+void StreamFilter::push(const vec4<T>* row) {
+    filter_prep_row(kernel, row, w, slot(rows_in));
+    if (rows_in == 0) {
+        for (int y = -r; y < 0; y++) {
+            std::copy_n(slot(0), w, slot(y));
+        }
+    }
+    rows_in++;
+    while (rows_out + r < rows_in) {
+        emit_row();
+    }
+}
+
+void StreamFilter::push_row(const ivec4* row) { push(row); }
+
+void StreamFilter::push_row(const uvec4* row) { push(row); }
+
+void StreamFilter::emit_row() {
+    for (int k = 0; k < 2 * r + 1; k++) {
+        rows[k] = slot(rows_out - r + k);
+    }
+    filter_emit_row(kernel, rows.data(), w, inv_kmag,
+                    out.data());
+    sink(out.data());
+    rows_out++;
+}
+
+// Rows below the last are copies of it. Each copy lands in
+// the slot of a row that is no longer needed.
+void StreamFilter::finish() {
+    if (rows_in == 0) {
+        return;
+    }
+    int last = rows_in - 1;
+    int filled = rows_in;
+    while (rows_out < rows_in) {
+        for (; filled <= rows_out + r; filled++) {
+            std::copy_n(slot(last), w, slot(filled));
+        }
+        emit_row();
+    }
+}